@@ -45,8 +45,9 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Virtual address at which to receive page mappings containing client
+// requests, followed by room for the data pages of a vectored write.
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - IPC_MAXPAGES * PGSIZE);
 
 void
 serve_init(void)
@@ -294,6 +295,113 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 }
 
 
+// Return the block of req->req_fileid that holds byte req->req_offset
+// as the reply page, read-only, in *pg_store and *perm_store.  The
+// page is the block cache's own, shared rather than copied, so that
+// spawn can map program text and data straight from it.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset >= o->o_file->f_size)
+		return -E_INVAL;
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	// Read the block in, so that there is a page to send
+	(void) *(volatile char *) blk;
+	*pg_store = blk;
+	*perm_store = PTE_P | PTE_U;
+	return 0;
+}
+
+// Read at most req->req_n bytes from the current seek position in
+// req->req_fileid, as serve_read does, but return them in place: the
+// reply carries the block cache's own pages that hold them, read-only,
+// the first byte at the seek position's offset into the first page.
+// Blocks that are adjacent on disk go as one range, and a file too
+// fragmented for IPC_VEC_MAX ranges gets a short read.  Returns the
+// number of bytes read, or < 0 on error.
+int
+serve_readv(envid_t envid, struct Fsreq_readv *req, struct IpcMsg *reply)
+{
+	struct OpenFile *o;
+	struct IpcVec *iv = NULL;
+	off_t off, end;
+	uint32_t bno;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_readv %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	off = o->o_fd->fd_offset;
+	if (off >= o->o_file->f_size)
+		return 0;
+	end = off + MIN(req->req_n, IPC_MAXPAGES * BLKSIZE - off % BLKSIZE);
+	end = MIN(end, o->o_file->f_size);
+	for (bno = off / BLKSIZE; bno * BLKSIZE < end; bno++) {
+		if ((r = file_get_block(o->o_file, bno, &blk)) < 0) {
+			if (bno == off / BLKSIZE)
+				return r;
+			end = bno * BLKSIZE;
+			break;
+		}
+		// Read the block in, so that there is a page to send
+		(void) *(volatile char *) blk;
+		if (iv && (char *) iv->iv_va + iv->iv_npages * BLKSIZE == blk) {
+			iv->iv_npages++;
+		} else if (reply->im_nvec < IPC_VEC_MAX) {
+			iv = &reply->im_vec[reply->im_nvec++];
+			iv->iv_va = blk;
+			iv->iv_npages = 1;
+			iv->iv_perm = PTE_P | PTE_U;
+		} else {
+			end = bno * BLKSIZE;
+			break;
+		}
+	}
+
+	o->o_fd->fd_offset = end;
+	return end - off;
+}
+
+// Write req->req_n bytes, which came in the 'npages' pages at 'data'
+// after the request page, to req->req_fileid at the current seek
+// position, as serve_write does.  Returns the number of bytes written,
+// or < 0 on error.
+int
+serve_writev(envid_t envid, struct Fsreq_writev *req, const void *data, size_t npages)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_writev %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	if ((r = file_write(o->o_file, data, MIN(req->req_n, npages * PGSIZE),
+			    o->o_fd->fd_offset)) < 0)
+		return r;
+
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
@@ -304,7 +412,7 @@ serve_sync(envid_t envid, union Fsipc *req)
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and map are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
@@ -318,12 +426,20 @@ void
 serve(void)
 {
 	uint32_t req, whom;
+	struct IpcMsg reply;
+	size_t npages;
 	int perm, r;
 	void *pg;
 
+	// Each reply goes out with the wait for the next request, and each
+	// request's pages replace the last one's at fsreq.
+	whom = 0;
+	reply.im_nvec = 0;
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = ipc_reply_waitv(whom, &reply, (int32_t *) &whom,
+				      fsreq, IPC_MAXPAGES, &perm, &npages);
+		if ((int32_t) req < 0 && whom == 0)
+			continue; // the reply failed; its client is gone
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -332,20 +448,33 @@ serve(void)
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
 			continue; // just leave it hanging...
 		}
 
 		pg = NULL;
+		reply.im_nvec = 0;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, &fsreq->map, &pg, &perm);
+		} else if (req == FSREQ_READV) {
+			r = serve_readv(whom, &fsreq->readv, &reply);
+		} else if (req == FSREQ_WRITEV) {
+			r = serve_writev(whom, &fsreq->writev, fsreq + 1, npages - 1);
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		reply.im_value = r;
+		if (pg) {
+			reply.im_nvec = 1;
+			reply.im_vec[0].iv_va = pg;
+			reply.im_vec[0].iv_npages = 1;
+			reply.im_vec[0].iv_perm = perm;
+		}
 	}
 }
 
@@ -356,6 +485,10 @@ umain(int argc, char **argv)
 	binaryname = "fs";
 	cprintf("FS is running\n");
 
+	// Every file request waits on us, so don't let CPU-bound
+	// envs push us down the run queues.
+	sys_env_set_priority(0, ENV_PRIO_HIGH);
+
 	// Check that we are able to do I/O
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
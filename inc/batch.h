@@ -0,0 +1,24 @@
+#ifndef JOS_INC_BATCH_H
+#define JOS_INC_BATCH_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// The system call batch page, mapped read/write at USYSBATCH by
+// sys_submit(0).  The library queues calls here and sys_submit(n) runs
+// the first n of them in one kernel entry.
+
+struct SysBatchEntry {
+	uint32_t sb_num;		// SYS_* number
+	uint32_t sb_args[5];
+	int32_t sb_ret;			// Filled in by sys_submit
+};
+
+#define SYSBATCH_MAX	((PGSIZE - sizeof(uint32_t)) / sizeof(struct SysBatchEntry))
+
+struct SysBatch {
+	uint32_t sb_count;		// Entries queued, kept by the library
+	struct SysBatchEntry sb_ent[SYSBATCH_MAX];
+};
+
+#endif	// !JOS_INC_BATCH_H
@@ -6,6 +6,7 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/ipc.h>
 
 typedef int32_t envid_t;
 
@@ -38,6 +39,14 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling priority levels.  Level 0 is the most urgent; the
+// scheduler moves envs between levels on its own unless they have been
+// pinned to one with sys_env_set_priority().
+#define ENV_NPRIO		4
+#define ENV_PRIO_HIGH		0
+#define ENV_PRIO_LOW		(ENV_NPRIO - 1)
+#define ENV_PRIO_AUTO		(-1)	// unpin: let the scheduler decide
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -59,6 +68,10 @@ struct Env {
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 	pde_t *env_kern_pgdir;	// Kernel virtual address of page dir
+	uint32_t env_cpumask;		// CPUs that may cache our mappings
+	struct EnvInfo *env_info;	// Kernel address of our UENVINFO page
+	struct SysBatch *env_batch;	// ... and of our USYSBATCH page, or NULL
+	struct Mailbox *env_mbox;	// ... and of our IPC mailbox, or NULL
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
@@ -69,12 +82,40 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	size_t env_ipc_dstpages;	// Pages in the window at env_ipc_dstva
+	size_t env_ipc_npages;		// Pages received there
 
 	bool env_ipc_sending;
 	envid_t env_ipc_send_envid;
 	uint32_t env_ipc_send_value;
 	void *env_ipc_srcva;
 	int env_ipc_send_perm;
+	bool env_ipc_calling;		// Receive at env_ipc_dstva once sent
+	int env_ipc_nvec;		// Ranges sent by sys_ipc_sendv, or 0
+	struct IpcVec env_ipc_vec[IPC_VEC_MAX];
+
+	// Senders blocked sending to us, oldest first, linked through
+	// env_ipc_send_next (valid while env_ipc_sending)
+	struct Env *env_ipc_senders;
+	struct Env *env_ipc_senders_tail;
+	struct Env *env_ipc_send_next;
+	struct Env *env_ipc_send_prev;
+
+	// Futex sleep, on a chain of sleepers linked through
+	// env_futex_next (valid while env_futex_waiting)
+	bool env_futex_waiting;
+	physaddr_t env_futex_pa;	// Physical address slept on
+	unsigned env_futex_deadline;	// time_msec() to give up at, or 0
+	struct Env *env_futex_next;
+	struct Env *env_futex_prev;
+
+	// Scheduler run queue linkage (valid while ENV_RUNNABLE)
+	struct Env *env_rq_next;
+	struct Env *env_rq_prev;
+	int env_rq_cpu;			// CPU whose run queue holds us, or -1
+	uint64_t env_last_tsc;		// TSC when last scheduled
+	int env_prio;			// Current priority level
+	bool env_prio_pinned;		// Level set by sys_env_set_priority
 };
 
 #endif // !JOS_INC_ENV_H
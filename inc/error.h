@@ -27,6 +27,7 @@ enum {
 	E_NOT_SUPP	,	// Operation not supported
 
 	E_AGAIN		,	// Resource not available, try again
+	E_TIMEOUT	,	// Timed out
 
 	MAXERROR
 };
@@ -70,7 +70,13 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns a block of the file as the reply page
+	FSREQ_MAP,
+	// Vectored read and write move the data in pages of their own
+	// after the request page, up to IPC_MAXPAGES in all
+	FSREQ_READV,
+	FSREQ_WRITEV
 };
 
 union Fsipc {
@@ -108,6 +114,18 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
+	struct Fsreq_readv {
+		int req_fileid;
+		size_t req_n;
+	} readv;
+	struct Fsreq_writev {
+		int req_fileid;
+		size_t req_n;
+	} writev;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
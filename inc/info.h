@@ -0,0 +1,20 @@
+#ifndef JOS_INC_INFO_H
+#define JOS_INC_INFO_H
+
+#include <inc/types.h>
+
+// Kernel info pages, mapped read-only into every environment so that
+// the library can answer common queries without a system call.
+
+// One page for the whole system, at USYSINFO.
+struct SysInfo {
+	uint32_t si_msec;		// time_msec(), updated every tick
+};
+
+// One page per environment, at UENVINFO.
+struct EnvInfo {
+	int32_t ei_id;			// The env's own envid_t
+	uint32_t ei_cpunum;		// CPU it was last scheduled on
+};
+
+#endif	// !JOS_INC_INFO_H
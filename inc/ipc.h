@@ -0,0 +1,28 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_IPC_H
+#define JOS_INC_IPC_H
+
+#include <inc/types.h>
+
+// Vectored IPC.  A message sent with sys_ipc_sendv() and its kin
+// carries a list of page ranges, each with its own permissions, which
+// the receiver maps one after another into a window of pages it names
+// when it receives.
+
+#define IPC_VEC_MAX	8	// Ranges in one message
+#define IPC_MAXPAGES	64	// Pages in one message, and in a window
+
+struct IpcVec {
+	void *iv_va;		// Page-aligned start of the range
+	uint32_t iv_npages;
+	int iv_perm;		// As for sys_page_map
+};
+
+struct IpcMsg {
+	uint32_t im_value;
+	int im_nvec;
+	struct IpcVec im_vec[IPC_VEC_MAX];
+};
+
+#endif	// !JOS_INC_IPC_H
@@ -22,6 +22,9 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/info.h>
+#include <inc/batch.h>
+#include <inc/sync.h>
 
 #define USED(x)		(void)(x)
 
@@ -30,9 +33,14 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
+extern const volatile struct SysInfo sysinfo;
+extern const volatile struct EnvInfo envinfo;
+
+// Our own Env.  It is found through our env info page, not kept in a
+// global, so that it is right in each env sharing memory after sfork.
+#define thisenv		(&envs[ENVX(envinfo.ei_id)])
 
 // exit.c
 void	exit(void);
@@ -50,15 +58,30 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(bool share);
+int	sys_env_load_elf(envid_t env, void *image, size_t npages);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_priority(envid_t env, int prio);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
+int	sys_page_alloc_large(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_send_async(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_try_recv(void *rcv_pg);
+int	sys_ipc_sendv(envid_t to_env, const struct IpcMsg *msg);
+int	sys_ipc_recvv(void *rcv_pg, size_t npages);
+int	sys_ipc_callv(envid_t to_env, const struct IpcMsg *msg, void *rcv_pg, size_t npages);
+int	sys_ipc_reply_waitv(envid_t to_env, const struct IpcMsg *msg, void *rcv_pg, size_t npages);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_submit(uint32_t n);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned timeout);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
 unsigned int sys_time_msec(void);
 int sys_net_send(const void *buf, uint32_t len);
 int sys_net_recv(void *buf, uint32_t len);
@@ -76,13 +99,33 @@ sys_exofork(void)
 	return ret;
 }
 
+// batch.c
+int	batch_page_alloc(envid_t env, void *pg, int perm);
+int	batch_page_map(envid_t src_env, void *src_pg,
+		       envid_t dst_env, void *dst_pg, int perm);
+int	batch_page_unmap(envid_t env, void *pg);
+int	batch_flush(void);
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int	ipc_send_async(envid_t to_env, uint32_t value, void *pg, int perm);
+int32_t ipc_try_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+void	ipc_sendv(envid_t to_env, const struct IpcMsg *msg);
+int32_t ipc_recvv(envid_t *from_env_store, void *pg, size_t npages,
+		  int *perm_store, size_t *npages_store);
+int32_t ipc_callv(envid_t to_env, const struct IpcMsg *msg,
+		  void *rcv_pg, size_t rcv_npages, size_t *npages_store);
+int32_t ipc_reply_waitv(envid_t to_env, const struct IpcMsg *msg,
+			envid_t *from_env_store, void *rcv_pg, size_t rcv_npages,
+			int *perm_store, size_t *npages_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -105,6 +148,7 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	read_map(int fd, off_t offset, void *va);
 
 // pageref.c
 int	pageref(void *addr);
@@ -50,12 +50,12 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |  RO ENVS, RO SYSINFO at top  | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
- *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *                     |          RO ENVINFO          | R-/R-  PGSIZE
+ * USTACKTOP,UENVINFO  +------------------------------+ 0xeebfe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebfd000
  *                     |                              |
@@ -74,6 +74,8 @@
  *                     | - - - - - - - - - - - - - - -|                   |
  *                     |  User STAB Data (optional)   |                 PTSIZE
  *    USTABDATA ---->  +------------------------------+ 0x00200000        |
+ *                     |      System Call Batch       |                   |
+ *    USYSBATCH ---->  +------------------------------+ 0x001ff000        |
  *                     |       Empty Memory (*)       |                   |
  *    0 ------------>  +------------------------------+                 --+
  *
@@ -114,6 +116,8 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only system info page (see inc/info.h), above the envs
+#define USYSINFO	(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -126,6 +130,9 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// Read-only env info page (see inc/info.h).  It takes the place of the
+// guard page: writes to it still fault.
+#define UENVINFO	USTACKTOP
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
@@ -137,6 +144,8 @@
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)
+// System call batch page (see inc/batch.h), just below the STABS
+#define USYSBATCH	(USTABDATA - PGSIZE)
 
 // Used for packet buffers in zero copy implementation
 #define UTXBASE		0
@@ -65,10 +65,16 @@
 #define PTE_PS		0x080	// Page Size
 #define PTE_G		0x100	// Global
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware, so user
+// processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_AVAIL bits that fork, in the library and in sys_fork, gives
+// meaning to: PTE_SHARE pages are shared with the child as they are,
+// and PTE_COW marks copy-on-write page table entries.
+#define PTE_SHARE	0x400
+#define PTE_COW		0x800
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -88,7 +94,9 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_PCIDE	0x00020000	// Process-Context Identifiers (IA-32e only)
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -96,6 +104,16 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID leaf 1 feature flags
+#define CPUID_SEP	0x00000800	// %edx: sysenter and sysexit
+#define CPUID_PGE	0x00002000	// %edx: global pages
+#define CPUID_PCID	0x00020000	// %ecx: process-context identifiers
+
+// Model-specific registers
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
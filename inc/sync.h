@@ -0,0 +1,46 @@
+#ifndef JOS_INC_SYNC_H
+#define JOS_INC_SYNC_H
+
+#include <inc/types.h>
+
+// Sleeping locks for user environments, built on sys_futex_wait and
+// sys_futex_wake.  They work between threads of one env, between envs
+// after sfork, and between envs that share the page they are in with
+// PTE_SHARE.  Initialize each with its *_init function, or zero it.
+
+// A mutex: 0 unlocked, 1 locked, 2 locked with sleepers.
+struct Mutex {
+	volatile uint32_t m_state;
+};
+
+// A condition variable.  c_seq changes on every signal, so a waiter
+// that saw the old value can't miss one.
+struct Cond {
+	volatile uint32_t c_seq;
+	volatile uint32_t c_nwait;	// Envs in cond_wait
+};
+
+// A counting semaphore.
+struct Sem {
+	volatile uint32_t s_count;
+	volatile uint32_t s_nwait;	// Envs sleeping in sem_wait
+};
+
+void	mutex_init(struct Mutex *m);
+void	mutex_lock(struct Mutex *m);
+bool	mutex_trylock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+
+void	cond_init(struct Cond *c);
+void	cond_wait(struct Cond *c, struct Mutex *m);
+int	cond_timedwait(struct Cond *c, struct Mutex *m, unsigned msec);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
+
+void	sem_init(struct Sem *s, uint32_t count);
+void	sem_wait(struct Sem *s);
+int	sem_timedwait(struct Sem *s, unsigned msec);
+bool	sem_trywait(struct Sem *s);
+void	sem_post(struct Sem *s);
+
+#endif	// !JOS_INC_SYNC_H
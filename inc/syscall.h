@@ -24,6 +24,21 @@ enum {
 	SYS_net_recv,
 	SYS_net_tdt,
 	SYS_net_rdt,
+	SYS_env_set_priority,
+	SYS_page_alloc_large,
+	SYS_submit,
+	SYS_fork,
+	SYS_env_load_elf,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_ipc_send_async,
+	SYS_ipc_try_recv,
+	SYS_ipc_sendv,
+	SYS_ipc_recvv,
+	SYS_ipc_callv,
+	SYS_ipc_reply_waitv,
+	SYS_futex_wait,
+	SYS_futex_wake,
 	NSYSCALLS
 };
 
@@ -283,4 +283,49 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add incr to *addr and return the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t incr)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (incr), "+m" (*addr)
+		     :
+		     : "cc", "memory");
+	return incr;
+}
+
+// Atomically set *addr to newval if it equals oldval.
+// Returns the value *addr held before.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (result), "+m" (*addr)
+		     : "r" (newval), "0" (oldval)
+		     : "cc", "memory");
+	return result;
+}
+
+// Atomically set the bits of mask in *addr.
+static inline void
+atomic_or(volatile uint32_t *addr, uint32_t mask)
+{
+	asm volatile("lock; orl %1, %0"
+		     : "+m" (*addr)
+		     : "r" (mask)
+		     : "cc", "memory");
+}
+
+// Atomically clear the bits of *addr that are clear in mask.
+static inline void
+atomic_and(volatile uint32_t *addr, uint32_t mask)
+{
+	asm volatile("lock; andl %1, %0"
+		     : "+m" (*addr)
+		     : "r" (mask)
+		     : "cc", "memory");
+}
+
 #endif /* !JOS_INC_X86_H */
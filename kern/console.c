@@ -9,10 +9,18 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Held by cprintf() for a whole message, so that output from different
+// CPUs doesn't interleave.
+struct spinlock cons_lock = SPINLOCK_INIT("cons_lock");
+
+// Protects the input buffer below and the keyboard shift state.
+static struct spinlock cons_in_lock = SPINLOCK_INIT("cons_in_lock");
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -405,6 +413,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	spin_lock(&cons_in_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -412,6 +421,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	spin_unlock(&cons_in_lock);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -427,13 +437,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons_in_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_in_lock);
+	return c;
 }
 
 // output a character to the console
@@ -3,12 +3,17 @@
 #include <inc/string.h>
 #include <inc/error.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
 
 static struct E1000 *base;
 
+// The transmit and receive rings are independent, so senders and
+// receivers on different CPUs don't wait on each other.
+static struct spinlock e1000_tx_lock = SPINLOCK_INIT("e1000_tx_lock");
+static struct spinlock e1000_rx_lock = SPINLOCK_INIT("e1000_rx_lock");
+
 struct tx_desc *tx_descs;
-// #define N_TXDESC (PGSIZE / sizeof(struct tx_desc))
-// char tx_packet_buffer[N_TXDESC][TX_PACKET_SIZE];
+char (*tx_packet_buffer)[TX_PACKET_SIZE];
 
 int
 e1000_tx_init()
@@ -19,8 +24,17 @@ e1000_tx_init()
 		panic("e1000_tx_init: out of memory");
 	tx_descs = (struct tx_desc *)mmio_map_region(page2pa(pp), PGSIZE);
 
+	// Allocate the packet buffers
+	static_assert(N_TXDESC * TX_PACKET_SIZE <= PGSIZE << TX_BUFFER_ORDER);
+	if (!(pp = page_alloc_contig(TX_BUFFER_ORDER, ALLOC_ZERO)))
+		panic("e1000_tx_init: out of memory");
+	// The driver holds a reference, so that unmapping the buffers from
+	// an env (ZERO_COPY) never frees them under the card.
+	for (int i = 0; i < (1 << TX_BUFFER_ORDER); i++)
+		pp[i].pp_ref = 1;
+	tx_packet_buffer = page2kva(pp);
+
 	// Initialize all descriptors
-	memset(tx_packet_buffer, '\0', N_TXDESC * TX_PACKET_SIZE);
 	for (int i = 0; i < N_TXDESC; i++) {
 		tx_descs[i].addr = PADDR(tx_packet_buffer[i]);
 		tx_descs[i].cmd = E1000_TX_CMD_RS | E1000_TX_CMD_EOP;
@@ -42,8 +56,7 @@ e1000_tx_init()
 }
 
 struct rx_desc *rx_descs;
-// #define N_RXDESC (PGSIZE / sizeof(struct rx_desc))
-// char rx_packet_buffer[N_RXDESC][RX_PACKET_SIZE];
+char (*rx_packet_buffer)[RX_PACKET_SIZE];
 
 int
 e1000_rx_init()
@@ -54,9 +67,17 @@ e1000_rx_init()
 		panic("e1000_rx_init: out of memory");
 	rx_descs = (struct rx_desc *)mmio_map_region(page2pa(pp), PGSIZE);
 
+	// Allocate the packet buffers
+	static_assert(N_RXDESC * RX_PACKET_SIZE <= PGSIZE << RX_BUFFER_ORDER);
+	if (!(pp = page_alloc_contig(RX_BUFFER_ORDER, ALLOC_ZERO)))
+		panic("e1000_rx_init: out of memory");
+	// The driver holds a reference, so that unmapping the buffers from
+	// an env (ZERO_COPY) never frees them under the card.
+	for (int i = 0; i < (1 << RX_BUFFER_ORDER); i++)
+		pp[i].pp_ref = 1;
+	rx_packet_buffer = page2kva(pp);
+
 	// Initialize all descriptors
-	// You should allocate some pages as receive buffer
-	memset(rx_packet_buffer, '\0', N_RXDESC * RX_PACKET_SIZE);
 	for (int i = 0; i < N_RXDESC; i++) 
 		rx_descs[i].addr = PADDR(rx_packet_buffer[i]);
 
@@ -97,10 +118,13 @@ e1000_tx(const void *buf, uint32_t len)
 {
 	// Send 'len' bytes in 'buf' to ethernet
 	// Hint: buf is a kernel virtual address
+	spin_lock(&e1000_tx_lock);
 	uint32_t tdt = base->TDT;
 	struct tx_desc *desc = &tx_descs[tdt];
-	if (!(desc->status & E1000_TX_STATUS_DD)) 
+	if (!(desc->status & E1000_TX_STATUS_DD)) {
+		spin_unlock(&e1000_tx_lock);
 		return -E_AGAIN;
+	}
 
 #ifndef ZERO_COPY
 	memset(tx_packet_buffer[tdt], '\0', TX_PACKET_SIZE);
@@ -109,6 +133,7 @@ e1000_tx(const void *buf, uint32_t len)
 	desc->length = len;
 	desc->status &= ~E1000_TX_STATUS_DD;
 	base->TDT = (base->TDT + 1) % N_TXDESC;
+	spin_unlock(&e1000_tx_lock);
 
 	return 0;
 }
@@ -122,10 +147,13 @@ e1000_rx(void *buf, uint32_t len)
 	// the packet
 	// Do not forget to reset the decscriptor and
 	// give it back to hardware by modifying RDT
+	spin_lock(&e1000_rx_lock);
 	uint32_t rdt = (base->RDT + 1) % N_TXDESC;
 	struct rx_desc *desc = &rx_descs[rdt];
-	if (!(desc->status & E1000_RX_STATUS_DD)) 
+	if (!(desc->status & E1000_RX_STATUS_DD)) {
+		spin_unlock(&e1000_rx_lock);
 		return -E_AGAIN;
+	}
 
 	if (len < desc->length) 
 		panic("e1000_rx: buf is too small to hold the packet");
@@ -133,10 +161,12 @@ e1000_rx(void *buf, uint32_t len)
 #ifndef ZERO_COPY
 	memmove(buf, rx_packet_buffer[rdt], desc->length);
 #endif
+	int length = desc->length;
 	desc->status &= ~E1000_RX_STATUS_DD;
 	base->RDT = rdt;
+	spin_unlock(&e1000_rx_lock);
 	
-	return desc->length;
+	return length;
 }
 
 #ifdef ZERO_COPY
@@ -87,8 +87,14 @@ struct rx_desc {
 #define N_TXDESC (PGSIZE / sizeof(struct tx_desc))
 #define N_RXDESC (PGSIZE / sizeof(struct rx_desc))
 
-char tx_packet_buffer[N_TXDESC][TX_PACKET_SIZE] __attribute__((aligned(PGSIZE)));
-char rx_packet_buffer[N_RXDESC][RX_PACKET_SIZE] __attribute__((aligned(PGSIZE)));
+// Packet buffers are physically contiguous blocks of 2^order pages
+// from page_alloc_contig: 128 pages hold 256 descriptors' worth of
+// either kind.
+#define TX_BUFFER_ORDER 7
+#define RX_BUFFER_ORDER 7
+
+extern char (*tx_packet_buffer)[TX_PACKET_SIZE];
+extern char (*rx_packet_buffer)[RX_PACKET_SIZE];
 
 int pci_e1000_attach(struct pci_func *pcif);
 int e1000_tx_init();
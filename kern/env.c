@@ -6,6 +6,7 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 #include <inc/elf.h>
+#include <inc/info.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -16,11 +17,26 @@
 #include <kern/spinlock.h>
 #include <kern/kpti.h>
 #include <kern/e1000.h>
+#include <kern/tlb.h>
+#include <kern/mbox.h>
+#include <kern/futex.h>
 
 struct Env *envs __user_mapped_data = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// Protects the env table: env_free_list, env ids, every env_status
+// transition and the IPC fields.  Ordered before the VM locks, which are
+// ordered (by envs[] index) before the scheduler and page locks.
+// Every context switch takes it, so it is an MCS lock.
+struct spinlock env_lock = MCS_SPINLOCK_INIT("env_lock");
+
+// One lock per envs[] slot guarding the user half of that env's
+// env_pgdir and env_kern_pgdir.  An env's own CPU may take its lock
+// without env_lock, since a running env is never freed under it;
+// anyone else must look the env up under env_lock first.
+static struct spinlock env_vm_locks[NENV];
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -69,6 +85,9 @@ struct Pseudodesc gdt_pd = {
 // If checkperm is set, the specified environment must be either the
 // current environment or an immediate child of the current environment.
 //
+// The caller must hold env_lock unless envid names the current
+// environment, which can't be freed while it runs.
+//
 // RETURNS
 //   0 on success, -E_BAD_ENV on error.
 //   On success, sets *env_store to the environment.
@@ -110,6 +129,54 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Lock the user half of e's address space.
+void
+env_vm_lock(struct Env *e)
+{
+	spin_lock(&env_vm_locks[e - envs]);
+	tlb_batch_enter(e);
+}
+
+void
+env_vm_unlock(struct Env *e)
+{
+	// Other CPUs must drop stale mappings before anyone else can
+	// change e's page tables.
+	tlb_batch_exit(e);
+	spin_unlock(&env_vm_locks[e - envs]);
+}
+
+// Lock the address spaces of a and b, which may be the same env,
+// in envs[] order so that two CPUs can't deadlock on the pair.
+void
+env_vm_lock_pair(struct Env *a, struct Env *b)
+{
+	if (a == b) {
+		env_vm_lock(a);
+		return;
+	}
+	if (a > b) {
+		struct Env *t = a;
+		a = b;
+		b = t;
+	}
+	env_vm_lock(a);
+	env_vm_lock(b);
+}
+
+void
+env_vm_unlock_pair(struct Env *a, struct Env *b)
+{
+	if (a == b) {
+		env_vm_unlock(a);
+		return;
+	}
+	// One shootdown for both, sent before either lock is released
+	tlb_batch_exit(b);
+	env_vm_unlock(a);
+	spin_unlock(&env_vm_locks[b - envs]);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -126,7 +193,9 @@ env_init(void)
 		envs[i].env_link = env_free_list;
 		envs[i].env_id = 0;
 		envs[i].env_status = ENV_FREE;
+		envs[i].env_rq_cpu = -1;
 		env_free_list = &envs[i];
+		__spin_initlock(&env_vm_locks[i], "env_vm_lock");
 	}
 
 	// Per-CPU part of the initialization
@@ -159,7 +228,7 @@ env_init_percpu(void)
 // Allocate a page directory, set e->env_pgdir accordingly,
 // and initialize the kernel portion of the new environment's address space.
 // Do NOT (yet) map anything into the user portion
-// of the environment's virtual address space.
+// of the environment's virtual address space, except its env info page.
 //
 // Returns 0 on success, < 0 on error.  Errors include:
 //	-E_NO_MEM if page directory or table could not be allocated.
@@ -167,7 +236,7 @@ env_init_percpu(void)
 static int
 env_setup_vm(struct Env *e)
 {
-	int i;
+	int i, r;
 	struct PageInfo *p = NULL;
 
 	// Allocate a page for the page directory
@@ -237,7 +306,8 @@ env_setup_vm(struct Env *e)
 
 	kp->pp_ref += 1;
 	e->env_kern_pgdir = page2kva(kp);
-	// hold user page table
+	// hold user page table: below UTOP the page tables are shared with
+	// env_pgdir, and user_page_insert() and friends keep it that way
 	for (uintptr_t i = 0; i < ULIM; i += PTSIZE) {
 		e->env_kern_pgdir[PDX(i)] = e->env_pgdir[PDX(i)];
 	}
@@ -247,20 +317,33 @@ env_setup_vm(struct Env *e)
 	}
 
 
+	// The env info page, with a reference for e->env_info as well as
+	// the mapping, which the env is free to remove.
+	if (!(p = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	p->pp_ref += 1;
+	if ((r = user_page_insert(e, p, (void *) UENVINFO, PTE_U | PTE_P)) < 0) {
+		page_decref(p);
+		return r;
+	}
+	e->env_info = page2kva(p);
+	// The batch page and the mailbox are only allocated on first use
+	e->env_batch = NULL;
+	e->env_mbox = NULL;
+
 #ifdef ZERO_COPY
-	int r;
 	for (int vaddr = UTXBASE; vaddr < UTXBASE + N_TXDESC * TX_PACKET_SIZE; vaddr += PGSIZE) {
 		    struct PageInfo* p = pa2page(PADDR((void*)((uintptr_t)tx_packet_buffer) + vaddr - UTXBASE));
 			if (p == NULL)
 				panic("env_setup_vm: pa2page failed");
-			if ((r = page_insert(e->env_pgdir, p, (void*)vaddr, PTE_U | PTE_W | PTE_PCD | PTE_PWT)) < 0) 
+			if ((r = user_page_insert(e, p, (void*)vaddr, PTE_U | PTE_W | PTE_PCD | PTE_PWT)) < 0) 
 				panic("page_insert: %e", r);
     }
 	for (int vaddr = URXBASE; vaddr < URXBASE + N_RXDESC * RX_PACKET_SIZE; vaddr += PGSIZE) {
 		struct PageInfo* p = pa2page(PADDR((void*)((uintptr_t)rx_packet_buffer) + vaddr - URXBASE));
 		if (p == NULL)
 			panic("env_setup_vm: pa2page failed");
-		if ((r = page_insert(e->env_pgdir, p, (void*)vaddr, PTE_U | PTE_W | PTE_PCD | PTE_PWT)) < 0) 
+		if ((r = user_page_insert(e, p, (void*)vaddr, PTE_U | PTE_W | PTE_PCD | PTE_PWT)) < 0) 
 			panic("page_insert: %e", r);
 	}
 #endif
@@ -271,6 +354,8 @@ env_setup_vm(struct Env *e)
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// It is left ENV_NOT_RUNNABLE, so that no other CPU picks it up before
+// the caller has finished setting it up.  The caller must hold env_lock.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENV environments are allocated
@@ -295,13 +380,17 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	if (generation <= 0)	// Don't create a negative env_id.
 		generation = 1 << ENVGENSHIFT;
 	e->env_id = generation | (e - envs);
+	e->env_info->ei_id = e->env_id;
 
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_cpunum = cpunum();
+	e->env_prio = ENV_PRIO_HIGH;
+	e->env_prio_pinned = 0;
 	e->env_brk = UTEXT;
+	e->env_cpumask = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -334,9 +423,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 	e->env_ipc_sending = 0;
+	e->env_ipc_calling = 0;
+	e->env_ipc_nvec = 0;
+	e->env_ipc_senders = e->env_ipc_senders_tail = NULL;
+	e->env_futex_waiting = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
+	env_set_status(e, ENV_NOT_RUNNABLE);
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -367,9 +461,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 		struct PageInfo *page = page_alloc(0);
 		if (page == NULL) 
 			panic("region_alloc: page_alloc failed");
-		if ((r = page_insert(e->env_pgdir, page, (void *)i, PTE_W | PTE_U)) < 0)
-			panic("region_alloc: %e", r);
-		if ((r = page_insert(e->env_kern_pgdir, page, (void *)i, PTE_W | PTE_U)) < 0) 
+		if ((r = user_page_insert(e, page, (void *)i, PTE_W | PTE_U)) < 0)
 			panic("region_alloc: %e", r);
 	}
 }
@@ -460,6 +552,173 @@ load_icode(struct Env *e, uint8_t *binary)
 	lcr3(PADDR(kern_pgdir));
 }
 
+// The exec page cache.  Every instance of a program maps the same
+// block-cache pages for its text and data, which the file server keys
+// by file and offset, so those are shared already.  The one page that
+// can't be mapped as is, where a segment's file data gives way to BSS,
+// is kept here ready-made and mapped copy-on-write into each instance.
+// Entries are keyed by the source page and the length of file data on
+// it, and a hit is checked against the source, which the file server
+// may have rewritten since.  Ordered after the VM locks and before the
+// page lock.
+#define EXECCACHE_SIZE	64
+
+struct ExecPage {
+	struct PageInfo *ep_src;	// Block-cache page it was made from
+	size_t ep_len;			// Bytes copied from it; zero after
+	struct PageInfo *ep_page;	// The copy, which holds a reference
+};
+
+static struct ExecPage execcache[EXECCACHE_SIZE];
+static struct spinlock execcache_lock = SPINLOCK_INIT("execcache_lock");
+
+// Statistics, for memstat
+static uint32_t execcache_npages;	// Entries in use
+static uint32_t execcache_hits;
+static uint32_t execcache_misses;
+static uint32_t execcache_shared;	// File pages mapped straight through
+
+//
+// Map at va in e a page holding the first len bytes of src and zeroes
+// after, from the cache if it has one.
+//
+static int
+execcache_map(struct Env *e, struct PageInfo *src, size_t len, void *va, int perm)
+{
+	struct ExecPage *ep = &execcache[PGNUM(page2pa(src)) % EXECCACHE_SIZE];
+	struct PageInfo *pp;
+	int r;
+
+	spin_lock(&execcache_lock);
+	if (ep->ep_page && ep->ep_src == src && ep->ep_len == len &&
+	    memcmp(page2kva(ep->ep_page), page2kva(src), len) == 0) {
+		execcache_hits++;
+	} else {
+		if (!(pp = page_alloc(ALLOC_ZERO))) {
+			spin_unlock(&execcache_lock);
+			return -E_NO_MEM;
+		}
+		memcpy(page2kva(pp), page2kva(src), len);
+		pp->pp_ref = 1;
+		if (ep->ep_page)
+			page_decref(ep->ep_page);
+		else
+			execcache_npages++;
+		ep->ep_src = src;
+		ep->ep_len = len;
+		ep->ep_page = pp;
+		execcache_misses++;
+	}
+	r = user_page_insert(e, ep->ep_page, va, perm & PTE_W ? (perm & ~PTE_W) | PTE_COW : perm);
+	spin_unlock(&execcache_lock);
+	return r;
+}
+
+void
+execcache_print_stats(void)
+{
+	uint32_t lookups;
+
+	spin_lock(&execcache_lock);
+	lookups = execcache_hits + execcache_misses;
+	cprintf("exec cache: %u/%u pages, %u hits, %u misses (%u%% hit rate), "
+		"%u file pages shared\n",
+		execcache_npages, EXECCACHE_SIZE, execcache_hits, execcache_misses,
+		lookups ? execcache_hits * 100 / lookups : 0, execcache_shared);
+	spin_unlock(&execcache_lock);
+}
+
+//
+// Load the ELF binary whose file pages 'src' maps at 'image', page i
+// of the file at image + i*PGSIZE for i < npages, into e.  As in
+// load_icode, each ELF_PROG_LOAD segment goes at its p_va and e starts
+// at the entry point.  But the file pages, which the file server
+// shares from its block cache, are mapped instead of copied: read-only
+// for text, copy-on-write for data.  A page that holds both the end of
+// a segment's file data and some of its BSS comes from the exec page
+// cache, copied only the first time.  The rest of the BSS is the zero
+// page, copy-on-write, so it takes memory only as it is written.
+// The caller holds both envs' VM locks.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_EXEC if the image does not start with valid ELF headers.
+//	-E_INVAL if a segment lies beyond the image or above UTOP,
+//		or its pages are not mapped in 'src'.
+//	-E_NO_MEM on memory exhaustion.
+//
+int
+env_load_elf(struct Env *e, struct Env *src, uintptr_t image, size_t npages)
+{
+	struct PageInfo *pp;
+	struct Proghdr *ph, seg;
+	struct Elf elf;
+	uintptr_t va, fileend, end, off;
+	pte_t *pte;
+	int i, perm, r, nshared = 0;
+
+	// The file server may write the file meanwhile, so work from
+	// copies of the headers
+	if (!npages || !(pp = page_lookup(src->env_pgdir, (void *) image, &pte)) ||
+	    (*pte & PTE_PS))
+		return -E_NOT_EXEC;
+	elf = *(struct Elf *) page2kva(pp);
+	if (elf.e_magic != ELF_MAGIC || elf.e_phoff > PGSIZE ||
+	    elf.e_phnum > (PGSIZE - elf.e_phoff) / sizeof(struct Proghdr))
+		return -E_NOT_EXEC;
+	ph = (struct Proghdr *) ((uint8_t *) page2kva(pp) + elf.e_phoff);
+
+	e->env_brk = 0;
+	for (i = 0; i < elf.e_phnum; i++) {
+		seg = ph[i];
+		if (seg.p_type != ELF_PROG_LOAD)
+			continue;
+		if (seg.p_filesz > seg.p_memsz ||
+		    PGOFF(seg.p_va) != PGOFF(seg.p_offset) ||
+		    seg.p_va + seg.p_memsz < seg.p_va ||
+		    seg.p_va + seg.p_memsz > UTOP ||
+		    seg.p_offset + seg.p_filesz < seg.p_offset ||
+		    seg.p_offset + seg.p_filesz > npages * PGSIZE)
+			return -E_INVAL;
+
+		perm = PTE_U | PTE_P;
+		if (seg.p_flags & ELF_PROG_FLAG_WRITE)
+			perm |= PTE_W;
+		end = seg.p_va + seg.p_memsz;
+		fileend = seg.p_filesz ? seg.p_va + seg.p_filesz : ROUNDDOWN(seg.p_va, PGSIZE);
+		off = seg.p_offset - PGOFF(seg.p_va);
+		for (va = ROUNDDOWN(seg.p_va, PGSIZE); va < end; va += PGSIZE, off += PGSIZE) {
+			if (va >= fileend) {
+				pp = zero_page;
+			} else {
+				pp = page_lookup(src->env_pgdir, (void *) (image + off), &pte);
+				if (!pp || (*pte & PTE_PS))
+					return -E_INVAL;
+			}
+
+			// Only the page ending the file data needs a copy, and
+			// only if BSS follows it there
+			if (va < fileend && fileend < MIN(end, va + PGSIZE)) {
+				if ((r = execcache_map(e, pp, fileend - va, (void *) va, perm)) < 0)
+					return r;
+				continue;
+			}
+			if ((r = user_page_insert(e, pp, (void *) va,
+						  perm & PTE_W ? (perm & ~PTE_W) | PTE_COW : perm)) < 0)
+				return r;
+			if (pp != zero_page)
+				nshared++;
+		}
+		e->env_brk = MAX(e->env_brk, ROUNDUP(end, PGSIZE));
+	}
+
+	spin_lock(&execcache_lock);
+	execcache_shared += nshared;
+	spin_unlock(&execcache_lock);
+
+	e->env_tf.tf_eip = elf.e_entry;
+	return 0;
+}
+
 //
 // Allocates a new env with env_alloc, loads the named elf
 // binary into it with load_icode, and sets its env_type.
@@ -473,9 +732,11 @@ env_create(uint8_t *binary, enum EnvType type)
 	// LAB 3: Your code here.
 	struct Env *env;
 	int r;
+	spin_lock(&env_lock);
 	if ((r = env_alloc(&env, 0)) < 0) {
 		panic("env_create: %e", r);
 	}
+	spin_unlock(&env_lock);
 
 	load_icode(env, binary);
 	env->env_type = type;
@@ -486,14 +747,93 @@ env_create(uint8_t *binary, enum EnvType type)
 		env->env_tf.tf_eflags |= FL_IOPL_MASK;
 	}
 
+	spin_lock(&env_lock);
+	env_set_status(env, ENV_RUNNABLE);
+	spin_unlock(&env_lock);
+}
+
+//
+// Move env e to 'status'.  Every env_status transition after env_init
+// must go through here so that the scheduler's run queues and its count
+// of live environments stay in sync: an env is on a run queue exactly
+// while it is ENV_RUNNABLE.  The caller must hold env_lock.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	unsigned old_status = e->env_status;
+
+	e->env_status = status;
+	sched_note_status(e, old_status);
+}
+
+//
+// Queue 'sender', which is about to block sending to 'dst', behind any
+// others already waiting on 'dst'.  Receives take them in this order.
+// The caller must hold env_lock.
+//
+void
+env_ipc_enqueue(struct Env *dst, struct Env *sender)
+{
+	sender->env_ipc_send_next = NULL;
+	sender->env_ipc_send_prev = dst->env_ipc_senders_tail;
+	if (dst->env_ipc_senders_tail)
+		dst->env_ipc_senders_tail->env_ipc_send_next = sender;
+	else
+		dst->env_ipc_senders = sender;
+	dst->env_ipc_senders_tail = sender;
+}
+
+//
+// Unlink 'sender' from the queue of senders waiting on 'dst'.
+// The caller must hold env_lock.
+//
+void
+env_ipc_dequeue(struct Env *dst, struct Env *sender)
+{
+	if (sender->env_ipc_send_prev)
+		sender->env_ipc_send_prev->env_ipc_send_next = sender->env_ipc_send_next;
+	else
+		dst->env_ipc_senders = sender->env_ipc_send_next;
+	if (sender->env_ipc_send_next)
+		sender->env_ipc_send_next->env_ipc_send_prev = sender->env_ipc_send_prev;
+	else
+		dst->env_ipc_senders_tail = sender->env_ipc_send_prev;
+	sender->env_ipc_send_next = sender->env_ipc_send_prev = NULL;
+}
+
+//
+// Take curenv, which must be ENV_RUNNING or ENV_DYING, off this CPU
+// and move it to 'status'.  Once it is runnable, or blocked where
+// another env can wake it, another CPU may run and even free it, so
+// first switch to kern_pgdir and forget it.  If another CPU asked for
+// it to be destroyed while it ran here, free it instead.
+// The caller must hold env_lock.
+//
+void
+env_deschedule(unsigned status)
+{
+	struct Env *e = curenv;
+
+	assert(e->env_status == ENV_RUNNING || e->env_status == ENV_DYING);
+	lcr3(PADDR(kern_pgdir));
+	// The cr3 switch flushed this CPU of e's mappings
+	atomic_and(&e->env_cpumask, ~(1 << cpunum()));
+	curenv = NULL;
+	if (e->env_status == ENV_DYING)
+		env_free(e);
+	else
+		env_set_status(e, status);
 }
 
 //
 // Frees env e and all memory it uses.
+// The caller must hold env_lock, and e must not be running on another CPU.
 //
 void
 env_free(struct Env *e)
 {
+	struct Env *sender;
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
@@ -501,12 +841,17 @@ env_free(struct Env *e)
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
-	if (e == curenv)
+	if (e == curenv) {
 		lcr3(PADDR(kern_pgdir));
+		atomic_and(&e->env_cpumask, ~(1 << cpunum()));
+	}
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Wait out anybody still mapping pages into e.
+	env_vm_lock(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -515,6 +860,12 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a large page has no page table to free
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			user_page_remove(e, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -525,31 +876,20 @@ env_free(struct Env *e)
 				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
 		}
 
-		// free the page table itself
+		// free the page table itself, which env_kern_pgdir shares
 		e->env_pgdir[pdeno] = 0;
+		e->env_kern_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
 	}
-	
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-
-		// only look at mapped page tables
-		if (!(e->env_kern_pgdir[pdeno] & PTE_P))
-			continue;
-
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_kern_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
 
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_kern_pgdir, PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
-		e->env_kern_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+	// drop the kernel's reference to the env info page
+	page_decref(pa2page(PADDR(e->env_info)));
+	e->env_info = NULL;
+	if (e->env_batch) {
+		page_decref(pa2page(PADDR(e->env_batch)));
+		e->env_batch = NULL;
 	}
+	mbox_free(e);
 
 	for (pdeno = PDX(KERNBASE); pdeno < PDX(~0); pdeno++) {
 		// only look at mapped page tables
@@ -569,15 +909,37 @@ env_free(struct Env *e)
 	pa = PADDR(e->env_kern_pgdir);
 	e->env_kern_pgdir = 0;
 	page_decref(pa2page(pa));
+	env_vm_unlock(e);
+
+	// A sender blocked in sys_ipc_try_send must not be found by a
+	// later receiver once it is gone.  Its target, which would have
+	// emptied its queue when freed, is still the env in that slot.
+	if (e->env_ipc_sending) {
+		env_ipc_dequeue(&envs[ENVX(e->env_ipc_send_envid)], e);
+		e->env_ipc_sending = 0;
+	}
+
+	// Anybody still blocked sending to e would wait forever
+	while ((sender = e->env_ipc_senders) != NULL) {
+		env_ipc_dequeue(e, sender);
+		sender->env_ipc_sending = 0;
+		sender->env_ipc_calling = 0;
+		sender->env_ipc_nvec = 0;
+		sender->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		env_set_status(sender, ENV_RUNNABLE);
+	}
+
+	futex_cancel(e);
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	env_set_status(e, ENV_FREE);
 	e->env_link = env_free_list;
 	env_free_list = e;
 }
 
 //
 // Frees environment e.
+// The caller must hold env_lock, which is released.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
@@ -587,8 +949,10 @@ env_destroy(struct Env *e)
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	if ((e->env_status == ENV_RUNNING || e->env_status == ENV_DYING) &&
+	    curenv != e) {
+		env_set_status(e, ENV_DYING);
+		spin_unlock(&env_lock);
 		return;
 	}
 
@@ -596,8 +960,10 @@ env_destroy(struct Env *e)
 
 	if (curenv == e) {
 		curenv = NULL;
+		spin_unlock(&env_lock);
 		sched_yield();
 	}
+	spin_unlock(&env_lock);
 }
 
 static void
@@ -686,9 +1052,56 @@ kpti_run(struct Env *e)
 	env_pop_tf(&e->env_tf);
 }
 
+//
+// Like env_pop_tf, but for an env that entered the kernel through
+// sysenter: return to it with sysexit, which takes the user %eip from
+// %edx and %esp from %ecx.  The sysenter stub in lib/syscall.c treats
+// both registers and the flags as clobbered.
+//
+__user_mapped_text
+__attribute__((noreturn))
+static void
+env_pop_tf_sysexit(struct Trapframe *tf)
+{
+	asm volatile(
+		"\tmovl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\tmovl 0x8(%%esp),%%edx\n" /* tf_eip */
+		"\tmovl 0x14(%%esp),%%ecx\n" /* tf_esp */
+		"\tsti\n"
+		"\tsysexit\n"
+		: : "g" (tf) : "memory");
+	panic("sysexit failed");  /* mostly to placate the compiler */
+}
+
+__user_mapped_text
+__attribute__((noreturn))
+__attribute__((noinline))
+static void
+kpti_run_sysexit(struct Env *e)
+{
+	curenv->env_cpunum = cpunum();
+	lcr3(PADDR(e->env_pgdir));
+	env_pop_tf_sysexit(&e->env_tf);
+}
+
+//
+// Resume curenv, which is e, after a system call made with sysenter.
+//
+void
+env_run_sysexit(struct Env *e)
+{
+	assert(e == curenv && e->env_status == ENV_RUNNING);
+	kpti_run_sysexit(e);
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
+// Switching to a new env must be done with env_lock held, and e must be
+// ENV_RUNNABLE; the lock is released.  Resuming curenv needs no lock.
 //
 // This function does not return.
 //
@@ -717,13 +1130,17 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
 	if (curenv != e) {
-		if (curenv != NULL && curenv->env_status == ENV_RUNNING) 
-			curenv->env_status = ENV_RUNNABLE;
+		if (curenv != NULL) 
+			env_deschedule(ENV_RUNNABLE);
+		env_set_status(e, ENV_RUNNING);
 		curenv = e;
-		e->env_status = ENV_RUNNING;
+		// Before kpti_run loads e's page tables: see tlb_batch_add
+		atomic_or(&e->env_cpumask, 1 << cpunum());
+		e->env_info->ei_cpunum = cpunum();
 		e->env_runs += 1;
+		e->env_last_tsc = read_tsc();
+		spin_unlock(&env_lock);
 	}
-	unlock_kernel();
 	kpti_run(e);
 
 	// panic("env_run not yet implemented");
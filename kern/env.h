@@ -5,8 +5,10 @@
 
 #include <inc/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 extern struct Env *envs;		// All environments
+extern struct spinlock env_lock;	// Env table and status lock
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -15,11 +17,22 @@ void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
+int	env_load_elf(struct Env *e, struct Env *src, uintptr_t image, size_t npages);
+void	execcache_print_stats(void);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_set_status(struct Env *e, unsigned status);
+void	env_deschedule(unsigned status);
+void	env_ipc_enqueue(struct Env *dst, struct Env *sender);
+void	env_ipc_dequeue(struct Env *dst, struct Env *sender);
+void	env_vm_lock(struct Env *e);
+void	env_vm_unlock(struct Env *e);
+void	env_vm_lock_pair(struct Env *a, struct Env *b);
+void	env_vm_unlock_pair(struct Env *a, struct Env *b);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
+void	env_run_sysexit(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
 // Without this extra macro, we couldn't pass macros like TEST to
@@ -0,0 +1,206 @@
+// Futexes: sleeping on a word of user memory.
+//
+// sys_futex_wait puts an env to sleep for as long as a word holds the
+// value it expects, and sys_futex_wake wakes the envs sleeping on it.
+// The user-level locks in lib/sync.c spin in user space and only come
+// here to sleep when a lock or semaphore is contended.
+//
+// Sleepers are keyed by the word's physical address, so envs that
+// share its page, through PTE_SHARE or sys_page_map, meet at the same
+// futex wherever each maps it.  A copy-on-write page would move to a
+// new frame on its first write, so it is copied first.
+//
+// The sleepers on an address are FIFO, and share one of FUTEX_HASH
+// chains with other addresses, linked through env_futex_next.  The
+// value check, the chains and the wakeups are all under env_lock, so a
+// wake that follows a change to the word can't miss a sleeper that saw
+// the old value.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/futex.h>
+
+#define FUTEX_HASH	64
+
+struct FutexChain {
+	struct Env *fc_head;
+	struct Env *fc_tail;
+};
+
+static struct FutexChain futex_chains[FUTEX_HASH];
+
+// Sleepers with a timeout, so futex_tick can skip the scan without them.
+static volatile uint32_t futex_ntimed;
+
+static struct FutexChain *
+futex_chain(physaddr_t pa)
+{
+	return &futex_chains[(pa >> 2) % FUTEX_HASH];
+}
+
+//
+// Find the physical address of the word at 'addr' in e, and its value.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if addr is above UTOP or not 4-byte aligned.
+//	-E_FAULT if addr is not mapped user-accessible.
+//	-E_NO_MEM if a copy-on-write page could not be copied.
+//
+static int
+futex_key(struct Env *e, uint32_t *addr, physaddr_t *pa_store, uint32_t *val_store)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r = 0;
+
+	if ((uintptr_t) addr >= UTOP || (uintptr_t) addr % 4)
+		return -E_INVAL;
+
+	env_vm_lock(e);
+	pp = page_lookup(e->env_pgdir, addr, &pte);
+	if (pp && (*pte & PTE_COW) && (r = user_page_cow(e, addr)) == 0)
+		pp = page_lookup(e->env_pgdir, addr, &pte);
+	if (r == 0 && (!pp || !(*pte & PTE_U)))
+		r = -E_FAULT;
+	if (r == 0) {
+		if (*pte & PTE_PS)
+			*pa_store = PTE_ADDR(*pte) + ((uintptr_t) addr & (PTSIZE - 1));
+		else
+			*pa_store = page2pa(pp) + PGOFF(addr);
+		*val_store = *(uint32_t *) KADDR(*pa_store);
+	}
+	env_vm_unlock(e);
+	return r;
+}
+
+static void
+futex_unlink(struct Env *e)
+{
+	struct FutexChain *fc = futex_chain(e->env_futex_pa);
+
+	if (e->env_futex_prev)
+		e->env_futex_prev->env_futex_next = e->env_futex_next;
+	else
+		fc->fc_head = e->env_futex_next;
+	if (e->env_futex_next)
+		e->env_futex_next->env_futex_prev = e->env_futex_prev;
+	else
+		fc->fc_tail = e->env_futex_prev;
+	e->env_futex_next = e->env_futex_prev = NULL;
+	if (e->env_futex_deadline)
+		futex_ntimed--;
+	e->env_futex_waiting = 0;
+}
+
+// Take e off its chain and make it runnable, returning r from its
+// sys_futex_wait.
+static void
+futex_wakeup(struct Env *e, int r)
+{
+	// Only we make a sleeper runnable
+	assert(e->env_status == ENV_NOT_RUNNABLE);
+	futex_unlink(e);
+	e->env_tf.tf_regs.reg_eax = r;
+	env_set_status(e, ENV_RUNNABLE);
+}
+
+//
+// Queue e to sleep on the word at 'addr' if it still holds 'val', for
+// at most 'timeout' milliseconds, or for good if timeout is 0.  The
+// caller then deschedules e, whose sys_futex_wait returns 0 when woken
+// and -E_TIMEOUT when the timeout runs out.
+// Returns 0 if e was queued, < 0 otherwise.  Errors are as for
+// futex_key, and:
+//	-E_AGAIN if the word no longer holds 'val'.
+//
+int
+futex_wait(struct Env *e, uint32_t *addr, uint32_t val, unsigned timeout)
+{
+	struct FutexChain *fc;
+	physaddr_t pa;
+	uint32_t cur;
+	int r;
+
+	if ((r = futex_key(e, addr, &pa, &cur)) < 0)
+		return r;
+	if (cur != val)
+		return -E_AGAIN;
+
+	e->env_futex_waiting = 1;
+	e->env_futex_pa = pa;
+	e->env_futex_deadline = 0;
+	if (timeout) {
+		// 0 means no deadline, so a deadline that wraps to it is
+		// pushed back a millisecond
+		e->env_futex_deadline = (time_msec() + timeout) ?: 1;
+		futex_ntimed++;
+	}
+	fc = futex_chain(pa);
+	e->env_futex_next = NULL;
+	e->env_futex_prev = fc->fc_tail;
+	if (fc->fc_tail)
+		fc->fc_tail->env_futex_next = e;
+	else
+		fc->fc_head = e;
+	fc->fc_tail = e;
+	return 0;
+}
+
+//
+// Wake up to 'n' of the envs sleeping on the word at 'addr' in e,
+// oldest first.  Returns the number woken, or < 0 on error.  Errors
+// are as for futex_key.
+//
+int
+futex_wake(struct Env *e, uint32_t *addr, int n)
+{
+	struct Env *w, *next;
+	physaddr_t pa;
+	uint32_t cur;
+	int r, nwoken = 0;
+
+	if ((r = futex_key(e, addr, &pa, &cur)) < 0)
+		return r;
+
+	for (w = futex_chain(pa)->fc_head; w && nwoken < n; w = next) {
+		next = w->env_futex_next;
+		if (w->env_futex_pa != pa)
+			continue;
+		futex_wakeup(w, 0);
+		nwoken++;
+	}
+	return nwoken;
+}
+
+// e is being freed: forget that it sleeps.
+void
+futex_cancel(struct Env *e)
+{
+	if (e->env_futex_waiting)
+		futex_unlink(e);
+}
+
+// Wake the sleepers whose timeout has run out.
+void
+futex_tick(void)
+{
+	unsigned now = time_msec();
+	struct Env *e, *next;
+	int i;
+
+	if (!futex_ntimed)
+		return;
+
+	spin_lock(&env_lock);
+	for (i = 0; i < FUTEX_HASH && futex_ntimed; i++)
+		for (e = futex_chains[i].fc_head; e; e = next) {
+			next = e->env_futex_next;
+			if (e->env_futex_deadline &&
+			    (int) (now - e->env_futex_deadline) >= 0)
+				futex_wakeup(e, -E_TIMEOUT);
+		}
+	spin_unlock(&env_lock);
+}
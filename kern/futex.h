@@ -0,0 +1,21 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// All called with env_lock held.
+int	futex_wait(struct Env *e, uint32_t *addr, uint32_t val, unsigned timeout);
+int	futex_wake(struct Env *e, uint32_t *addr, int n);
+void	futex_cancel(struct Env *e);
+
+// Called on CPU 0's timer tick, without env_lock.
+void	futex_tick(void);
+
+#endif	// !JOS_KERN_FUTEX_H
@@ -67,13 +67,6 @@ i386_init(void)
 	time_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
-
-	// Starting non-boot CPUs
-	boot_aps();
-
 #if !defined(TEST_NO_FS)
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
@@ -96,6 +89,10 @@ i386_init(void)
 	ENV_CREATE(user_icode, ENV_TYPE_USER);
 #endif // TEST*
 
+	// Starting non-boot CPUs.  Do this only once the first envs exist,
+	// since an AP that finds nothing to run drops into the monitor.
+	boot_aps();
+
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
@@ -141,6 +138,7 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -149,11 +147,8 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU.  The scheduler's own
+	// locks keep CPUs from picking the same env.
 	sched_yield();
 
 	// Remove this after you finish Exercise 6
@@ -0,0 +1,76 @@
+// Buffered IPC.
+//
+// sys_ipc_send_async leaves a message, and perhaps a page, in the
+// target's mailbox and returns at once instead of waiting for the
+// target to receive.  sys_ipc_recv takes mailbox messages, oldest
+// first, before any sender blocked in sys_ipc_try_send, so a server can
+// drain a burst of them without blocking in between.
+//
+// The mailbox is a kernel page, allocated on the first message, that
+// holds up to MBOX_MAX messages.  A page sent along stays referenced
+// from the mailbox until the message is received, or dropped when the
+// receiver is freed.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/mbox.h>
+
+//
+// Append a copy of msg to e's mailbox, which takes over its page
+// reference.  Returns 0 on success, < 0 on error.  Errors are:
+//	-E_AGAIN if the mailbox is full.
+//	-E_NO_MEM if the mailbox could not be allocated.
+//
+int
+mbox_put(struct Env *e, const struct MboxMsg *msg)
+{
+	struct Mailbox *mb = e->env_mbox;
+	struct PageInfo *pp;
+
+	if (!mb) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		pp->pp_ref += 1;
+		mb = e->env_mbox = page2kva(pp);
+	}
+	if (mb->mb_count == MBOX_MAX)
+		return -E_AGAIN;
+	mb->mb_msg[(mb->mb_head + mb->mb_count++) % MBOX_MAX] = *msg;
+	return 0;
+}
+
+//
+// Take the oldest message out of e's mailbox into msg, along with its
+// page reference.  Returns false if there is none.
+//
+bool
+mbox_get(struct Env *e, struct MboxMsg *msg)
+{
+	struct Mailbox *mb = e->env_mbox;
+
+	if (!mb || mb->mb_count == 0)
+		return false;
+	*msg = mb->mb_msg[mb->mb_head];
+	mb->mb_head = (mb->mb_head + 1) % MBOX_MAX;
+	mb->mb_count--;
+	return true;
+}
+
+//
+// Drop every message left in e's mailbox, and the mailbox itself.
+//
+void
+mbox_free(struct Env *e)
+{
+	struct MboxMsg msg;
+
+	if (!e->env_mbox)
+		return;
+	while (mbox_get(e, &msg))
+		if (msg.mm_page)
+			page_decref(msg.mm_page);
+	page_decref(pa2page(PADDR(e->env_mbox)));
+	e->env_mbox = NULL;
+}
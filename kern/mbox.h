@@ -0,0 +1,35 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_MBOX_H
+#define JOS_KERN_MBOX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// A message waiting in a mailbox for sys_ipc_recv.
+struct MboxMsg {
+	envid_t mm_from;
+	uint32_t mm_value;
+	struct PageInfo *mm_page;	// Page sent, which we hold a reference
+	int mm_perm;			// to, or NULL; and its perm
+};
+
+#define MBOX_MAX	((PGSIZE - 2 * sizeof(uint32_t)) / sizeof(struct MboxMsg))
+
+// An env's mailbox, a ring of messages in a kernel page of its own.
+struct Mailbox {
+	uint32_t mb_head;		// Oldest message
+	uint32_t mb_count;
+	struct MboxMsg mb_msg[MBOX_MAX];
+};
+
+// All called with env_lock held.
+int	mbox_put(struct Env *e, const struct MboxMsg *msg);
+bool	mbox_get(struct Env *e, struct MboxMsg *msg);
+void	mbox_free(struct Env *e);
+
+#endif	// !JOS_KERN_MBOX_H
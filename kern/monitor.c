@@ -13,6 +13,9 @@
 #include <kern/trap.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/tlb.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -33,6 +36,9 @@ static struct Command commands[] = {
 	{ "modifymapping", "Modify any mapping in the current address space", mon_modifymapping},
 	{ "memdump", "Dump the contents of a range of memory", mon_memdump},
 	{ "backtrace", "Stack backtrace", mon_backtrace},
+	{ "schedstat", "Display run queues and load balancer counters", mon_schedstat},
+	{ "lockstat", "Display spinlock contention statistics", mon_lockstat},
+	{ "memstat", "Display page allocator, TLB shootdown and exec cache counters", mon_memstat},
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -309,6 +315,29 @@ mon_memdump(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_schedstat(int argc, char **argv, struct Trapframe *tf)
+{
+	sched_print_stats();
+	return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	spin_print_stats();
+	return 0;
+}
+
+int
+mon_memstat(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_stats();
+	tlb_print_stats();
+	execcache_print_stats();
+	return 0;
+}
+
 
 /***** Kernel monitor command interpreter *****/
 
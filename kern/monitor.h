@@ -20,5 +20,8 @@ int mon_time(int argc, char **argv, struct Trapframe *tf);
 int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_modifymapping(int argc, char **argv, struct Trapframe *tf);
 int mon_memdump(int argc, char **argv, struct Trapframe *tf);
+int mon_schedstat(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_memstat(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
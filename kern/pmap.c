@@ -9,9 +9,11 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 #include <inc/queue.h>
 #include <kern/kpti.h>
 #include <kern/e1000.h>
+#include <kern/tlb.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -20,7 +22,61 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+struct SysInfo *sysinfo;	// Mapped read-only at USYSINFO
+struct PageInfo *zero_page;	// Mapped copy-on-write for lazy BSS
+static uint32_t pte_global;	// PTE_G if the CPU has global pages
+
+// Free physical memory is kept by a buddy allocator.  A free block of
+// 2^order pages starts at a page number that is a multiple of 2^order.
+// Its first page heads the block and sits on buddy_free[order], linked
+// forward through pp_link and back through page_buddy[].pb_prev; the
+// block's other pages keep a NULL pp_link.  Freeing a block merges it
+// with its buddy (page number ^ 2^order) for as long as that is free.
+struct PageBuddy {
+	struct PageInfo *pb_prev;	// previous block on its free list
+	uint8_t pb_order;		// order of the block, if pb_free
+	bool pb_free;			// page heads a free block
+};
+
+static struct PageBuddy *page_buddy;	// parallel to pages[]
+static struct PageInfo *buddy_free[BUDDY_MAX_ORDER + 1];
+
+// Protects the buddy allocator and every pp_ref: a page mapped into
+// several address spaces has its count changed from whichever CPUs
+// map it.  Every mapping change takes it, so it is an MCS lock.
+static struct spinlock page_lock = MCS_SPINLOCK_INIT("page_lock");
+
+// Per-CPU caches ("magazines") of free pages in front of the buddy
+// allocator.  page_alloc() and page_free() only touch the running CPU's
+// magazine, which needs no lock since the kernel runs with interrupts
+// off.  Only when it runs empty or full do PAGE_CACHE_BATCH pages move
+// between it and the buddy allocator, in one trip under page_lock.
+#define PAGE_CACHE_SIZE		32
+#define PAGE_CACHE_BATCH	16
+
+struct PageCache {
+	struct PageInfo *pc_pages[PAGE_CACHE_SIZE];	// LIFO stack
+	int pc_count;
+} __attribute__((aligned(64)));		// one cache line per CPU
+
+static struct PageCache page_caches[NCPU];
+
+// pp_link of a page sitting in a PageCache, so that page_free() can
+// still catch double frees.
+#define PAGE_CACHED	((struct PageInfo *) 1)
+
+// Free pages that idle CPUs have already zeroed, so that most
+// page_alloc(ALLOC_ZERO) calls skip the memset.  Linked through pp_link;
+// these pages are on no other free list.  Each idle pass zeroes at most
+// PAGE_ZERO_BATCH pages, to bound how late a halting CPU sees wakeups.
+#define PAGE_ZERO_POOL_MAX	256
+#define PAGE_ZERO_BATCH		8
+
+static struct spinlock page_zero_lock = SPINLOCK_INIT("page_zero_lock");
+static struct PageInfo *page_zero_list;
+static int page_zero_count;
+static uint32_t page_zero_hits;		// ALLOC_ZERO served from the pool
+static uint32_t page_zero_misses;	// ALLOC_ZERO that had to memset
 
 
 // --------------------------------------------------------------
@@ -66,6 +122,10 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void page_remove_alias(pde_t *pgdir, pde_t *alias, void *va);
+static int page_insert_large_alias(pde_t *pgdir, pde_t *alias,
+				   struct PageInfo *pp, void *va, int perm);
+static void boot_map_global(uintptr_t va, size_t size);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
@@ -87,7 +147,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the buddy allocator has been set up.
 // Note that when this function is called, we are still using entry_pgdir,
 // which only maps the first 4MB of physical memory.
 static void *
@@ -136,7 +196,7 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, ecx, edx;
 	size_t n;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
@@ -175,6 +235,17 @@ mem_init(void)
 	envs = (struct Env *) boot_alloc(NENV * sizeof(struct Env));
 	memset(envs, 0, NENV * sizeof(struct Env));
 
+	//////////////////////////////////////////////////////////////////////
+	// The system info page that user environments read at USYSINFO.
+	sysinfo = (struct SysInfo *) boot_alloc(PGSIZE);
+	memset(sysinfo, 0, PGSIZE);
+
+	//////////////////////////////////////////////////////////////////////
+	// The buddy allocator's per-page state, kept beside 'pages' so that
+	// the user-visible PageInfo stays as it is.
+	page_buddy = (struct PageBuddy *) boot_alloc(npages * sizeof(struct PageBuddy));
+	memset(page_buddy, 0, npages * sizeof(struct PageBuddy));
+
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -187,9 +258,32 @@ mem_init(void)
 	check_page_alloc();
 	check_page();
 
+	// The zero page, which env_load_elf maps copy-on-write for BSS.
+	// Our reference keeps any env from owning it alone, so it is
+	// never written in place.
+	zero_page = page_alloc(ALLOC_ZERO);
+	assert(zero_page);
+	zero_page->pp_ref = 1;
+
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
 
+	//////////////////////////////////////////////////////////////////////
+	// Under KPTI every trap and every return reloads %cr3, flushing the
+	// TLB.  Mappings that are the same in every env_pgdir and
+	// env_kern_pgdir -- the trampoline, the kernel stacks, UPAGES and
+	// UENVS -- are made global so that they survive those switches.
+	// User mappings are never global.
+	//
+	// PCID would also keep user mappings across the switches, but
+	// CR4.PCIDE can only be set in IA-32e mode, and we use 32-bit paging.
+	cpuid(1, NULL, NULL, &ecx, &edx);
+	if (edx & CPUID_PGE)
+		pte_global = PTE_G;
+	cprintf("KPTI: global pages %s, PCID %s\n",
+		pte_global ? "on" : "unsupported",
+		(ecx & CPUID_PCID) ? "needs IA-32e mode" : "unsupported");
+
 	//////////////////////////////////////////////////////////////////////
 	// Map 'pages' read-only by the user at linear address UPAGES
 	// Permissions:
@@ -197,7 +291,7 @@ mem_init(void)
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U);
+	boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U | pte_global);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -206,7 +300,11 @@ mem_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
-	boot_map_region(kern_pgdir, UENVS, PTSIZE, PADDR(envs), PTE_U);
+	// Only the array itself: USYSINFO follows in the same window.
+	static_assert(NENV * sizeof(struct Env) <= USYSINFO - UENVS);
+	boot_map_region(kern_pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE),
+			PADDR(envs), PTE_U | pte_global);
+	boot_map_region(kern_pgdir, USYSINFO, PGSIZE, PADDR(sysinfo), PTE_U | pte_global);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -234,6 +332,10 @@ mem_init(void)
 // #else
 	boot_map_region(kern_pgdir, KERNBASE, (size_t)(0 - KERNBASE), 0, PTE_W);
 // #endif
+	// env_setup_vm copies these into every env_pgdir.
+	boot_map_global((uintptr_t) __USER_MAP_BEGIN__,
+			__USER_MAP_END__ - __USER_MAP_BEGIN__);
+	boot_map_global((uintptr_t) envs, NENV * sizeof(struct Env));
 
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
@@ -249,6 +351,7 @@ mem_init(void)
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
 	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 
 	check_page_free_list(0);
 
@@ -291,21 +394,104 @@ mem_init_mp(void)
 	for (int i = 0; i < NCPU; i++) {
 		uintptr_t kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
 		boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE,
-						PADDR(percpu_kstacks[i]), PTE_W);
+						PADDR(percpu_kstacks[i]), PTE_W | pte_global);
     }
 }
 
+// Enable global pages on this CPU, once it runs on kern_pgdir.
+void
+mem_init_percpu(void)
+{
+	if (pte_global)
+		lcr4(rcr4() | CR4_PGE);
+}
+
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
 // Pages are reference counted, and free pages are kept on a linked list.
 // --------------------------------------------------------------
 
+// Push the free block of 2^order pages headed by pp on its free list.
+// Caller holds page_lock.
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	struct PageBuddy *pb = &page_buddy[pp - pages];
+
+	pb->pb_prev = NULL;
+	pb->pb_order = order;
+	pb->pb_free = true;
+	pp->pp_link = buddy_free[order];
+	if (pp->pp_link)
+		page_buddy[pp->pp_link - pages].pb_prev = pp;
+	buddy_free[order] = pp;
+}
+
+// Take the free block headed by pp off its free list.
+// Caller holds page_lock.
+static void
+buddy_unlink(struct PageInfo *pp)
+{
+	struct PageBuddy *pb = &page_buddy[pp - pages];
+
+	if (pb->pb_prev)
+		pb->pb_prev->pp_link = pp->pp_link;
+	else
+		buddy_free[pb->pb_order] = pp->pp_link;
+	if (pp->pp_link)
+		page_buddy[pp->pp_link - pages].pb_prev = pb->pb_prev;
+	pb->pb_free = false;
+	pp->pp_link = NULL;
+}
+
+// Allocate a block of 2^order pages, splitting a larger one if needed.
+// Returns its first page, or NULL.  Caller holds page_lock.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o <= BUDDY_MAX_ORDER && !buddy_free[o]; o++)
+		/* do nothing */;
+	if (o > BUDDY_MAX_ORDER)
+		return NULL;
+	pp = buddy_free[o];
+	buddy_unlink(pp);
+	// Keep the lower half, free the upper one
+	while (o > order) {
+		o--;
+		buddy_push(pp + (1 << o), o);
+	}
+	return pp;
+}
+
+// Free the block of 2^order pages starting at pp, merging it with its
+// free buddies.  Caller holds page_lock.
+static void
+buddy_free_block(struct PageInfo *pp, int order)
+{
+	size_t pn = pp - pages, bn;
+
+	if (page_buddy[pn].pb_free)
+		panic("buddy_free_block: page %u already free", pn);
+	for (; order < BUDDY_MAX_ORDER; order++) {
+		bn = pn ^ (1 << order);
+		if (bn >= npages || !page_buddy[bn].pb_free
+		    || page_buddy[bn].pb_order != order)
+			break;
+		buddy_unlink(&pages[bn]);
+		pn &= ~(1 << order);
+	}
+	buddy_push(&pages[pn], order);
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy allocator.
 //
 void
 page_init(void)
@@ -331,47 +517,123 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-
-	// Mark physical page 0 as in use
-	pages[0].pp_ref = 1;
-	pages[0].pp_link = NULL;
-
-	// The rest of base memory is free
-	assert(npages_basemem * PGSIZE == IOPHYSMEM);
 	size_t npages_mpentry = PGNUM(MPENTRY_PADDR);
+	size_t npages_inuse = PGNUM(PADDR((char *) boot_alloc(0)));  // get the first free VA
 	size_t i;
-	for (i = 1; i < npages_basemem; i++) {
-		// Mark AP entry code page as in use
-		if (i == npages_mpentry) {
-			pages[i].pp_ref = 1;
-			pages[i].pp_link = NULL;
-			continue;
-		}
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
-	}
 
-	// Mark IO hole as in use
-	size_t npages_extmem = PGNUM(EXTPHYSMEM);
-	for (i = npages_basemem; i < npages_extmem; i++) {
+	assert(npages_basemem * PGSIZE == IOPHYSMEM);
+
+	// Page 0, the AP entry code page, the IO hole, and the pages of
+	// kernel code and data, page tables, and other data structures
+	// are in use; base memory and the rest of extended memory are free.
+	//
+	// Free from the top down: each list then has its lowest block
+	// first, so the allocations made before kern_pgdir is loaded come
+	// from the low 4MB that entry_pgdir maps.
+	for (i = npages; i-- > 0; ) {
 		pages[i].pp_ref = 0;
 		pages[i].pp_link = NULL;
+		if (i == 0 || i == npages_mpentry
+		    || (i >= npages_basemem && i < npages_inuse))
+			continue;
+		buddy_free_block(&pages[i], 0);
 	}
+	// Page 0 and the AP entry code are never freed
+	pages[0].pp_ref = 1;
+	pages[npages_mpentry].pp_ref = 1;
+}
 
-	// Mark pages of kernel data and code, page tables, other data structures as in use
-	size_t npages_inuse = PGNUM(PADDR((char *) boot_alloc(0)));  // get the first free VA
-	for (i = npages_extmem; i < npages_inuse; i++) {
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = NULL;
+//
+// Move up to PAGE_CACHE_BATCH pages from the buddy allocator into pc.
+// Returns the number of pages now in pc.
+//
+static int
+page_cache_refill(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	while (pc->pc_count < PAGE_CACHE_BATCH && (pp = buddy_alloc(0))) {
+		pp->pp_link = PAGE_CACHED;
+		pc->pc_pages[pc->pc_count++] = pp;
 	}
+	spin_unlock(&page_lock);
+	return pc->pc_count;
+}
 
-	// The rest of memory is free
-	for (i = npages_inuse; i < npages; i++) {
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+//
+// Return the n least recently freed pages in pc to the buddy
+// allocator, keeping the cache-warm ones.
+//
+static void
+page_cache_drain(struct PageCache *pc, int n)
+{
+	int i;
+
+	spin_lock(&page_lock);
+	for (i = 0; i < n; i++) {
+		pc->pc_pages[i]->pp_link = NULL;
+		buddy_free_block(pc->pc_pages[i], 0);
 	}
+	spin_unlock(&page_lock);
+	pc->pc_count -= n;
+	memmove(pc->pc_pages, pc->pc_pages + n,
+		pc->pc_count * sizeof(pc->pc_pages[0]));
+}
+
+//
+// Empty this CPU's page cache, so that the buddy allocator holds every
+// free page it knows of.  Used by the checks below.
+//
+static void
+page_cache_flush(void)
+{
+	struct PageCache *pc = &page_caches[cpunum()];
+
+	page_cache_drain(pc, pc->pc_count);
+}
+
+//
+// Pop a page off this CPU's page cache, refilling it if empty.
+// Returns NULL if the buddy allocator is empty too.
+//
+static struct PageInfo *
+page_cache_take(void)
+{
+	struct PageCache *pc = &page_caches[cpunum()];
+	struct PageInfo *pp;
+
+	if (pc->pc_count == 0 && page_cache_refill(pc) == 0)
+		return NULL;
+	pp = pc->pc_pages[--pc->pc_count];
+	pp->pp_link = NULL;
+	return pp;
+}
+
+//
+// Pop a page off the zeroed pool, or return NULL if it is empty.
+// 'count' says whether this is an ALLOC_ZERO request to count as a
+// pool hit or miss.
+//
+static struct PageInfo *
+page_zero_take(bool count)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_zero_lock);
+	if ((pp = page_zero_list) != NULL) {
+		page_zero_list = pp->pp_link;
+		page_zero_count--;
+		pp->pp_link = NULL;
+	}
+	if (count) {
+		if (pp)
+			page_zero_hits++;
+		else
+			page_zero_misses++;
+	}
+	spin_unlock(&page_zero_lock);
+	return pp;
 }
 
 //
@@ -390,11 +652,13 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	if (page_free_list == NULL) 
-		return NULL;
-	struct PageInfo *alloc_page = page_free_list;
-	page_free_list = page_free_list->pp_link;
-	alloc_page->pp_link = NULL;
+	struct PageInfo *alloc_page;
+
+	if ((alloc_flags & ALLOC_ZERO) && (alloc_page = page_zero_take(true)))
+		return alloc_page;
+	// Out of plain free pages: the zeroed ones will do.
+	if (!(alloc_page = page_cache_take()))
+		return page_zero_take(false);
 
 	if (alloc_flags & ALLOC_ZERO) {
 		char *pa = (char *) page2kva(alloc_page);
@@ -404,6 +668,38 @@ page_alloc(int alloc_flags)
 	return alloc_page;
 }
 
+//
+// Called by an idle CPU before it halts: zero up to PAGE_ZERO_BATCH
+// free pages into the zeroed pool, until it holds PAGE_ZERO_POOL_MAX.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	// page_zero_count is read unlocked; overshooting the cap by a
+	// batch when several CPUs go idle at once is harmless.
+	for (i = 0; i < PAGE_ZERO_BATCH && page_zero_count < PAGE_ZERO_POOL_MAX; i++) {
+		if (!(pp = page_cache_take()))
+			break;
+		memset(page2kva(pp), 0, PGSIZE);
+		spin_lock(&page_zero_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_zero_count++;
+		spin_unlock(&page_zero_lock);
+	}
+}
+
+void
+page_print_stats(void)
+{
+	cprintf("zeroed pool: %d/%d pages, %u hits, %u misses\n",
+		page_zero_count, PAGE_ZERO_POOL_MAX,
+		page_zero_hits, page_zero_misses);
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -417,8 +713,81 @@ page_free(struct PageInfo *pp)
 	if (pp->pp_ref != 0 || pp->pp_link != NULL) 
 		panic("page_free: page in use");
 
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	struct PageCache *pc = &page_caches[cpunum()];
+	if (pc->pc_count == PAGE_CACHE_SIZE) 
+		page_cache_drain(pc, PAGE_CACHE_BATCH);
+	pp->pp_link = PAGE_CACHED;
+	pc->pc_pages[pc->pc_count++] = pp;
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// and returns the first one; order BUDDY_MAX_ORDER gives a 4MB frame
+// fit for a large page.  These bypass the page caches.  alloc_flags and
+// reference counts are as for page_alloc.  The block may be freed whole
+// with page_free_contig, or page by page with page_free.
+//
+// Returns NULL if no free block is large enough.
+//
+struct PageInfo *
+page_alloc_contig(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order < 0 || order > BUDDY_MAX_ORDER)
+		return NULL;
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block from page_alloc_contig to the free memory.
+// (Every page in it must have pp_ref 0.)
+//
+void
+page_free_contig(struct PageInfo *pp, int order)
+{
+	int i;
+
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref != 0 || pp[i].pp_link != NULL)
+			panic("page_free_contig: page in use");
+
+	spin_lock(&page_lock);
+	buddy_free_block(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Decrement the reference count on the 4MB block headed by pp, freeing
+// the whole block if there are no more refs.
+//
+static void
+page_decref_large(struct PageInfo *pp)
+{
+	bool last;
+
+	spin_lock(&page_lock);
+	last = --pp->pp_ref == 0;
+	spin_unlock(&page_lock);
+	if (last && !tlb_defer_free(pp, BUDDY_MAX_ORDER))
+		page_free_contig(pp, BUDDY_MAX_ORDER);
+}
+
+//
+// Take another reference to a page, for a holder other than a mapping.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
 }
 
 //
@@ -428,7 +797,13 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	bool last;
+
+	spin_lock(&page_lock);
+	last = --pp->pp_ref == 0;
+	spin_unlock(&page_lock);
+	// Other CPUs may still reach it through their TLBs
+	if (last && !tlb_defer_free(pp, 0))
 		page_free(pp);
 }
 
@@ -513,6 +888,23 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	}
 }
 
+//
+// Mark the pages covering [va, va+size), already mapped in kern_pgdir,
+// global.  Their mappings must never change.
+//
+static void
+boot_map_global(uintptr_t va, size_t size)
+{
+	uintptr_t end = ROUNDUP(va + size, PGSIZE);
+	pte_t *pte;
+
+	for (va = ROUNDDOWN(va, PGSIZE); va < end; va += PGSIZE) {
+		pte = pgdir_walk(kern_pgdir, (void *) va, false);
+		assert(pte && (*pte & PTE_P));
+		*pte |= pte_global;
+	}
+}
+
 //
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
@@ -567,17 +959,22 @@ int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	// Fill this function in
+	// A large page covering va has to be removed as a whole first
+	if ((pgdir[PDX(va)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return -E_INVAL;
+
 	pte_t *pte = pgdir_walk(pgdir, va, true);
 
 	if (pte == NULL) 
 		return -E_NO_MEM;
 
 	// in case of re-add pp_ref when pp is re-inserted at the same va
+	spin_lock(&page_lock);
 	pp->pp_ref += 1;
+	spin_unlock(&page_lock);
 
 	// A page has already mapped at 'va', it should be removed
 	if (*pte & PTE_P) {
-		assert(!(*pte & PTE_PS));  // large page should not be evicted
 		// pte_t *pgtab_entry = &pgdir[PDX(va)];
 		// struct PageInfo *pp_pgtab = pa2page(PTE_ADDR(*pgtab_entry));
 		// pp_pgtab->pp_ref += 1;
@@ -609,7 +1006,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 		return NULL;
 	if (pte_store) 
 		*pte_store = pte;
-	assert (!(*pte & PTE_PS));
+	// For a large page this is the first page of its 4MB block
 	return pa2page(PTE_ADDR(*pte));
 }
 
@@ -631,7 +1028,16 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 void
 page_remove(pde_t *pgdir, void *va)
 {
-	// Fill this function in
+	page_remove_alias(pgdir, NULL, va);
+}
+
+//
+// page_remove, where 'alias', if not NULL, is another page directory
+// that shares pgdir's page tables and so must lose a large page too.
+//
+static void
+page_remove_alias(pde_t *pgdir, pde_t *alias, void *va)
+{
 	pte_t *pte_store = NULL;
 	struct PageInfo *page = page_lookup(pgdir, va, &pte_store);
 
@@ -644,9 +1050,256 @@ page_remove(pde_t *pgdir, void *va)
 	// page_decref(pp_pgtab);
 
 	assert(pte_store != NULL);
-	page_decref(page);
-	*pte_store = 0;
-	tlb_invalidate(pgdir, va);
+	// Invalidate before the decref, which may free the page
+	if (*pte_store & PTE_PS) {
+		*pte_store = 0;
+		if (alias)
+			alias[PDX(va)] = 0;
+		// The UVPT view read the large page as a page table
+		tlb_invalidate(pgdir, (void *) (UVPT + (PDX(va) << PGSHIFT)));
+		tlb_invalidate(pgdir, va);
+		page_decref_large(page);
+	} else {
+		*pte_store = 0;
+		tlb_invalidate(pgdir, va);
+		page_decref(page);
+	}
+}
+
+//
+// Map the 4MB block 'pp' from page_alloc_contig(BUDDY_MAX_ORDER, ...)
+// at the PTSIZE-aligned 'va' with a single PTE_PS directory entry.
+// As with page_insert, a large page already mapped at 'va' is removed
+// and pp->pp_ref is incremented on success.  An empty page table at
+// 'va' is freed to make room, but one that still maps pages is not.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL if 'va' is not PTSIZE-aligned, 'pp' does not head a 4MB
+//     block, or 4KB pages are mapped in [va, va+PTSIZE)
+//
+int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	return page_insert_large_alias(pgdir, NULL, pp, va, perm);
+}
+
+// page_insert_large, keeping 'alias' as page_remove_alias does.
+static int
+page_insert_large_alias(pde_t *pgdir, pde_t *alias, struct PageInfo *pp,
+			void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *pp_pt;
+	pte_t *pt;
+	int i;
+
+	if ((uintptr_t) va % PTSIZE || (pp - pages) % (1 << BUDDY_MAX_ORDER))
+		return -E_INVAL;
+
+	if ((*pde & (PTE_P | PTE_PS)) == PTE_P) {
+		pt = (pte_t *) KADDR(PTE_ADDR(*pde));
+		for (i = 0; i < NPTENTRIES; i++)
+			if (pt[i] & PTE_P)
+				return -E_INVAL;
+		pp_pt = pa2page(PTE_ADDR(*pde));
+		*pde = 0;
+		if (alias)
+			alias[PDX(va)] = 0;
+		tlb_invalidate(pgdir, (void *) (UVPT + (PDX(va) << PGSHIFT)));
+		page_decref(pp_pt);
+	}
+
+	// in case of re-add pp_ref when pp is re-inserted at the same va
+	spin_lock(&page_lock);
+	pp->pp_ref += 1;
+	spin_unlock(&page_lock);
+
+	if (*pde & PTE_P)
+		page_remove_alias(pgdir, alias, va);
+
+	*pde = page2pa(pp) | perm | PTE_P | PTE_PS;
+	if (alias)
+		alias[PDX(va)] = *pde;
+	return 0;
+}
+
+//
+// User mappings under KPTI.  Below UTOP, an env's env_pgdir and
+// env_kern_pgdir hold the same page directory entries, so they share
+// every page table and large page: a user mapping is one PTE write,
+// takes one reference, and is visible in both.  These functions keep
+// the directory entries in step; lookups can use either directory.
+//
+
+int
+user_page_insert(struct Env *e, struct PageInfo *pp, void *va, int perm)
+{
+	int r;
+
+	// page_insert may add a page table, but frees none
+	if ((r = page_insert(e->env_pgdir, pp, va, perm)) == 0)
+		e->env_kern_pgdir[PDX(va)] = e->env_pgdir[PDX(va)];
+	return r;
+}
+
+int
+user_page_insert_large(struct Env *e, struct PageInfo *pp, void *va, int perm)
+{
+	return page_insert_large_alias(e->env_pgdir, e->env_kern_pgdir,
+				       pp, va, perm);
+}
+
+void
+user_page_remove(struct Env *e, void *va)
+{
+	page_remove_alias(e->env_pgdir, e->env_kern_pgdir, va);
+}
+
+//
+// Resolve a write fault on the PTE_COW page at 'va' in e's address
+// space.  If ours is the only mapping of the page, it is just made
+// writable again; otherwise it is replaced by a writable copy.
+// The caller holds e's VM lock.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL if there is no copy-on-write page at 'va'
+//   -E_NO_MEM if the copy couldn't be allocated
+//
+int
+user_page_cow(struct Env *e, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	bool sole;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP ||
+	    !(pp = page_lookup(e->env_pgdir, va, &pte)) ||
+	    (*pte & (PTE_PS | PTE_U | PTE_COW)) != (PTE_U | PTE_COW))
+		return -E_INVAL;
+
+	// Nobody can map the page anew while it is ours alone, as that
+	// would take our VM lock, so a count of 1 stays 1
+	spin_lock(&page_lock);
+	sole = pp->pp_ref == 1;
+	spin_unlock(&page_lock);
+	if (sole) {
+		*pte = (*pte & ~PTE_COW) | PTE_W;
+		tlb_invalidate(e->env_pgdir, va);
+		return 0;
+	}
+
+	if (!(copy = page_alloc(pp == zero_page ? ALLOC_ZERO : 0)))
+		return -E_NO_MEM;
+	if (pp != zero_page)
+		memcpy(page2kva(copy), page2kva(pp), PGSIZE);
+	if ((r = user_page_insert(e, copy, va, (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W)) < 0)
+		page_free(copy);
+	return r;
+}
+
+// The bottom of e's stack: the run of pages mapped below USTACKTOP.
+static uintptr_t
+user_stack_bottom(struct Env *e)
+{
+	uintptr_t va = USTACKTOP;
+	pte_t *pte;
+
+	while (va > 0 && page_lookup(e->env_pgdir, (void *) (va - PGSIZE), &pte) &&
+	       !(*pte & PTE_PS))
+		va -= PGSIZE;
+	return va;
+}
+
+//
+// Give 'child' a copy of 'parent's address space below UTOP, in one
+// pass over the parent's page tables.  Writable pages are mapped
+// PTE_COW in both, and PTE_SHARE pages are shared as they are.  Large
+// pages can't be copy-on-write, so those are copied now.  If 'share',
+// every page below the parent's stack is shared as if it were
+// PTE_SHARE, and only the stack is copy-on-write.  Pages the child
+// already maps, like its env info page, are left alone, and so is the
+// parent's batch page, which is its own.
+// The caller holds both envs' VM locks.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM if a page table or page couldn't be allocated
+//
+int
+user_vm_fork(struct Env *parent, struct Env *child, bool share)
+{
+	uint32_t pdeno, pteno;
+	uintptr_t limit = share ? user_stack_bottom(parent) : 0;
+	pde_t pde;
+	pte_t *pt, *cpt, pte;
+	struct PageInfo *pp;
+	bool copy;
+	void *va;
+	int r;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		pde = parent->env_pgdir[pdeno];
+		if (!(pde & PTE_P))
+			continue;
+
+		if (pde & PTE_PS) {
+			va = PGADDR(pdeno, 0, 0);
+			copy = !(pde & PTE_SHARE) && (uintptr_t) va >= limit;
+			pp = pa2page(PTE_ADDR(pde));
+			if (copy) {
+				if (!(pp = page_alloc_contig(BUDDY_MAX_ORDER, 0)))
+					return -E_NO_MEM;
+				memcpy(page2kva(pp), KADDR(PTE_ADDR(pde)), PTSIZE);
+			}
+			r = user_page_insert_large(child, pp, va, pde & PTE_SYSCALL);
+			if (r < 0 && copy)
+				page_free_contig(pp, BUDDY_MAX_ORDER);
+			if (r < 0)
+				return r;
+			continue;
+		}
+
+		if (!(cpt = pgdir_walk(child->env_pgdir, PGADDR(pdeno, 0, 0), true)))
+			return -E_NO_MEM;
+		child->env_kern_pgdir[pdeno] = child->env_pgdir[pdeno];
+		pt = (pte_t *) KADDR(PTE_ADDR(pde));
+
+		// A shared page has to be one page for both of us, so give
+		// the parent its own copy of any still copy-on-write
+		for (pteno = 0; share && pteno < NPTENTRIES; pteno++) {
+			va = PGADDR(pdeno, pteno, 0);
+			if ((uintptr_t) va < limit &&
+			    (pt[pteno] & (PTE_P | PTE_COW)) == (PTE_P | PTE_COW) &&
+			    (r = user_page_cow(parent, va)) < 0)
+				return r;
+		}
+
+		// One page_lock hold for the whole table's references
+		spin_lock(&page_lock);
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			pte = pt[pteno];
+			va = PGADDR(pdeno, pteno, 0);
+			if (!(pte & PTE_P) || (cpt[pteno] & PTE_P) ||
+			    va == (void *) USYSBATCH)
+				continue;
+			if ((pte & (PTE_W | PTE_COW)) && !(pte & PTE_SHARE) &&
+			    (uintptr_t) va >= limit) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				if (pt[pteno] & PTE_W) {
+					pt[pteno] = pte;
+					tlb_invalidate(parent->env_pgdir, va);
+				}
+			}
+			cpt[pteno] = PTE_ADDR(pte) | (pte & PTE_SYSCALL);
+			pa2page(PTE_ADDR(pte))->pp_ref += 1;
+		}
+		spin_unlock(&page_lock);
+	}
+	return 0;
 }
 
 //
@@ -659,6 +1312,8 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir || curenv->env_kern_pgdir == pgdir)
 		invlpg(va);
+	// Other CPUs running this address space are shot down in a batch
+	tlb_batch_add(pgdir, va);
 }
 
 //
@@ -741,6 +1396,9 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 			user_mem_check_addr = i == start ? (uintptr_t)va : i;
 			return -E_FAULT;
 		}
+		// the PDE of a large page stands for all 4MB of it
+		if (*pte & PTE_PS)
+			i = ROUNDDOWN(i, PTSIZE) + PTSIZE - PGSIZE;
 	}
 	
 	return 0;
@@ -752,6 +1410,7 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // If it can, then the function simply returns.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// The caller must not hold env_lock or env's VM lock.
 //
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
@@ -759,6 +1418,7 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
+		spin_lock(&env_lock);
 		env_destroy(env);	// may not return
 	}
 }
@@ -768,61 +1428,107 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Temporarily take every free block out of the buddy allocator, for
+// the checks that need to run out of memory.  The blocks are no longer
+// marked free, so pages freed meanwhile cannot merge into them.
 //
 static void
-check_page_free_list(bool only_low_memory)
+buddy_steal(struct PageInfo **saved)
 {
 	struct PageInfo *pp;
+	int o;
+
+	page_cache_flush();
+	for (o = 0; o <= BUDDY_MAX_ORDER; o++) {
+		saved[o] = buddy_free[o];
+		buddy_free[o] = NULL;
+		for (pp = saved[o]; pp; pp = pp->pp_link)
+			page_buddy[pp - pages].pb_free = false;
+	}
+}
+
+// Give back the blocks taken by buddy_steal.
+static void
+buddy_unsteal(struct PageInfo **saved)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = 0; o <= BUDDY_MAX_ORDER; o++) {
+		assert(!buddy_free[o]);
+		buddy_free[o] = saved[o];
+		for (pp = saved[o]; pp; pp = pp->pp_link)
+			page_buddy[pp - pages].pb_free = true;
+	}
+}
+
+// Count the pages in the buddy allocator.
+static int
+buddy_count_free(void)
+{
+	struct PageInfo *pp;
+	int o, nfree = 0;
+
+	page_cache_flush();
+	for (o = 0; o <= BUDDY_MAX_ORDER; o++)
+		for (pp = buddy_free[o]; pp; pp = pp->pp_link)
+			nfree += 1 << o;
+	return nfree;
+}
+
+//
+// Check that the pages in the buddy allocator are reasonable.
+//
+static void
+check_page_free_list(bool only_low_memory)
+{
+	struct PageInfo *pp, *blk;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int o;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	page_cache_flush();
+	if (!buddy_free[0] && !buddy_free[1])
+		panic("buddy allocator has no small blocks!");
 
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	// page_init ordered each free list lowest block first, so the
+	// next allocations come from the low memory entry_pgdir maps.
+	if (only_low_memory)
+		assert(PDX(page2pa(buddy_free[0] ? buddy_free[0] : buddy_free[1])) < pdx_limit);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
-	}
+	for (o = 0; o <= BUDDY_MAX_ORDER; o++)
+		for (blk = buddy_free[o]; blk; blk = blk->pp_link) {
+			// check that we didn't corrupt the free lists
+			assert(blk >= pages);
+			assert(blk + (1 << o) <= pages + npages);
+			assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+			assert((blk - pages) % (1 << o) == 0);
+			assert(page_buddy[blk - pages].pb_free);
+			assert(page_buddy[blk - pages].pb_order == o);
+
+			for (pp = blk; pp < blk + (1 << o); pp++) {
+				// if there's a page that shouldn't be free, try
+				// to make sure it eventually causes trouble.
+				if (PDX(page2pa(pp)) < pdx_limit)
+					memset(page2kva(pp), 0x97, 128);
+
+				// check a few pages that shouldn't be free
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+				// (new test for lab 4)
+				assert(page2pa(pp) != MPENTRY_PADDR);
+
+				if (page2pa(pp) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+			}
+		}
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
@@ -832,14 +1538,14 @@ check_page_free_list(bool only_low_memory)
 
 //
 // Check the physical page allocator (page_alloc(), page_free(),
-// and page_init()).
+// page_alloc_contig(), page_free_contig(), and page_init()).
 //
 static void
 check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct PageInfo *fl;
+	struct PageInfo *fl[BUDDY_MAX_ORDER + 1];
 	char *c;
 	int i;
 
@@ -847,8 +1553,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = buddy_count_free();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -864,11 +1569,11 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	buddy_steal(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
+	assert(!page_alloc_contig(0, 0));
 
 	// free and re-allocate?
 	page_free(pp0);
@@ -893,17 +1598,59 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	buddy_unsteal(fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// contiguous blocks are aligned to their size
+	assert((pp0 = page_alloc_contig(3, 0)));
+	assert((pp1 = page_alloc_contig(1, 0)));
+	assert((pp2 = page_alloc_contig(BUDDY_MAX_ORDER, 0)));
+	assert((pp0 - pages) % 8 == 0);
+	assert((pp1 - pages) % 2 == 0);
+	assert(page2pa(pp2) % PTSIZE == 0);
+	assert(pp1 + 2 <= pp0 || pp0 + 8 <= pp1);
+	assert(pp2 + (1 << BUDDY_MAX_ORDER) <= pp0 || pp0 + 8 <= pp2);
+	assert(!page_alloc_contig(BUDDY_MAX_ORDER + 1, 0));
+
+	buddy_steal(fl);
+
+	// a block splits to serve a smaller order, and merges back
+	page_free_contig(pp2, BUDDY_MAX_ORDER);
+	assert((pp = page_alloc_contig(0, 0)) == pp2);
+	assert(!page_alloc_contig(BUDDY_MAX_ORDER, 0));
+	assert(page_alloc_contig(BUDDY_MAX_ORDER - 1, 0) == pp2 + (1 << (BUDDY_MAX_ORDER - 1)));
+	page_free_contig(pp2 + (1 << (BUDDY_MAX_ORDER - 1)), BUDDY_MAX_ORDER - 1);
+	page_free_contig(pp, 0);
+	assert(page_alloc_contig(BUDDY_MAX_ORDER, 0) == pp2);
+	assert(!page_alloc_contig(0, 0));
+
+	// a block freed page by page merges back too
+	for (i = 0; i < 8; i++)
+		page_free(pp0 + i);
+	page_cache_flush();
+	assert(page_alloc_contig(3, 0) == pp0);
+	assert(!page_alloc_contig(0, 0));
+
+	// test flags
+	memset(page2kva(pp1), 1, 2 * PGSIZE);
+	page_free_contig(pp1, 1);
+	assert(page_alloc_contig(1, ALLOC_ZERO) == pp1);
+	c = page2kva(pp1);
+	for (i = 0; i < 2 * PGSIZE; i++)
+		assert(c[i] == 0);
+
+	buddy_unsteal(fl);
+
+	page_free_contig(pp0, 3);
+	page_free_contig(pp1, 1);
+	page_free_contig(pp2, BUDDY_MAX_ORDER);
+
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == buddy_count_free());
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -1011,7 +1758,7 @@ static void
 check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
+	struct PageInfo *fl[BUDDY_MAX_ORDER + 1];
 	pte_t *ptep, *ptep1;
 	void *va;
 	uintptr_t mm1, mm2;
@@ -1029,8 +1776,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	buddy_steal(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1150,7 +1896,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	buddy_unsteal(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -16,6 +16,8 @@ extern struct PageInfo *pages;
 extern size_t npages;
 
 extern pde_t *kern_pgdir;
+extern struct SysInfo *sysinfo;
+extern struct PageInfo *zero_page;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -51,20 +53,37 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Largest block page_alloc_contig() hands out: 2^10 pages, one 4MB
+// large page.
+#define BUDDY_MAX_ORDER	10
+
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_contig(int order, int alloc_flags);
+void	page_free_contig(struct PageInfo *pp, int order);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
+int	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void	page_incref(struct PageInfo *pp);
 void	page_decref(struct PageInfo *pp);
+void	page_zero_idle(void);
+void	page_print_stats(void);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
+int	user_page_insert(struct Env *e, struct PageInfo *pp, void *va, int perm);
+int	user_page_insert_large(struct Env *e, struct PageInfo *pp, void *va, int perm);
+void	user_page_remove(struct Env *e, void *va);
+int	user_page_cow(struct Env *e, void *va);
+int	user_vm_fork(struct Env *parent, struct Env *child, bool share);
+
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 
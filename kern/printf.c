@@ -5,6 +5,9 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+#include <kern/spinlock.h>
+
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +19,18 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
 
-	vprintfmt((void*)putch, &cnt, fmt, ap);
+	// Once panicking, print no matter who holds the lock: it may
+	// be us, and nobody will release it.
+	if (panicstr)
+		vprintfmt((void*)putch, &cnt, fmt, ap);
+	else {
+		spin_lock(&cons_lock);
+		vprintfmt((void*)putch, &cnt, fmt, ap);
+		spin_unlock(&cons_lock);
+	}
 	return cnt;
 }
 
@@ -7,76 +7,378 @@
 
 void sched_halt(void);
 
+// Per-CPU multi-level feedback run queues.  Every ENV_RUNNABLE
+// environment sits on exactly one queue: the one for its priority level
+// (env_prio) on the CPU it last ran on, linked through env_rq_next and
+// env_rq_prev.  Each level is FIFO, and rq_levels has bit L set iff
+// level L is non-empty, so picking the next env is O(1).
+//
+// Feedback rules:
+//   - An env preempted by the timer burned its whole timeslice and
+//     drops one level (sched_tick).
+//   - An env that blocks in IPC gave up the CPU early and rises one
+//     level (sched_boost_env).
+//   - Every SCHED_BOOST_TICKS all runnable envs go back to the top
+//     level, so CPU-bound envs can't starve forever.
+//   - Envs pinned with sys_env_set_priority() are exempt from all three.
+struct RunQueue {
+	struct Env *rq_head[ENV_NPRIO];
+	struct Env *rq_tail[ENV_NPRIO];
+	uint32_t rq_levels;		// bitmap of non-empty levels
+	int rq_len;
+
+	// Load balancer statistics, counted on the stealing CPU
+	uint32_t rq_steals;		// envs pulled from a sibling's queue
+	uint32_t rq_migrations;		// ... of which had run elsewhere before
+	uint32_t rq_halts;		// times the CPU found nothing and halted
+};
+
+// An idle CPU only steals from a busy sibling whose queue holds at least
+// this many envs, so a single waiting env stays near its warm cache.
+// Siblings that are halted or between envs may be robbed of anything.
+#define SCHED_STEAL_THRESHOLD	2
+// How far down a victim's queue to look for a cache-cold env.
+#define SCHED_STEAL_SCAN	4
+// An env that was scheduled less than this many cycles ago is assumed
+// to still have its working set in its last CPU's cache.
+#define SCHED_HOT_CYCLES	500000ULL
+// Timer ticks (10ms each) between global priority boosts.
+#define SCHED_BOOST_TICKS	100
+
+static struct RunQueue runqs[NCPU];
+
+// Protects runqs[], sched_nlive and every env's env_prio and run queue
+// linkage.  Status transitions, which move envs on and off the queues,
+// happen under env_lock, which is always taken first.
+static struct spinlock sched_lock = SPINLOCK_INIT("sched_lock");
+
+// Number of environments that are ENV_RUNNABLE, ENV_RUNNING or
+// ENV_DYING.  When this drops to zero there is nothing left to run.
+static int sched_nlive;
+
+static unsigned sched_boost_ticks;
+
+static bool
+status_is_live(unsigned status)
+{
+	return status == ENV_RUNNABLE || status == ENV_RUNNING ||
+	       status == ENV_DYING;
+}
+
+// Return the first env on the highest non-empty level of rq, or NULL.
+static struct Env *
+runq_first(struct RunQueue *rq)
+{
+	if (!rq->rq_levels)
+		return NULL;
+	return rq->rq_head[__builtin_ctz(rq->rq_levels)];
+}
+
+// Append e to the tail of its level on the run queue of the CPU it
+// last ran on.
+static void
+sched_enqueue(struct Env *e)
+{
+	struct RunQueue *rq;
+	int cpu = e->env_cpunum;
+	int prio = e->env_prio;
+
+	assert(e->env_rq_cpu < 0);
+	assert(prio >= 0 && prio < ENV_NPRIO);
+	if (cpu < 0 || cpu >= ncpu)
+		cpu = cpunum();
+	rq = &runqs[cpu];
+
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail[prio];
+	if (rq->rq_tail[prio])
+		rq->rq_tail[prio]->env_rq_next = e;
+	else
+		rq->rq_head[prio] = e;
+	rq->rq_tail[prio] = e;
+	rq->rq_levels |= 1 << prio;
+	rq->rq_len++;
+	e->env_rq_cpu = cpu;
+}
+
+// Unlink e from whichever run queue holds it.  Does nothing if e is
+// not queued.
+static void
+sched_dequeue(struct Env *e)
+{
+	struct RunQueue *rq;
+	int prio = e->env_prio;
+
+	if (e->env_rq_cpu < 0)
+		return;
+	rq = &runqs[e->env_rq_cpu];
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head[prio] = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail[prio] = e->env_rq_prev;
+	if (!rq->rq_head[prio])
+		rq->rq_levels &= ~(1 << prio);
+	rq->rq_len--;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+}
+
+// e just moved from old_status to e->env_status: put it on or take it
+// off the run queues and keep sched_nlive in step.
+void
+sched_note_status(struct Env *e, unsigned old_status)
+{
+	unsigned status = e->env_status;
+
+	spin_lock(&sched_lock);
+	if (old_status == ENV_RUNNABLE)
+		sched_dequeue(e);
+	if (status == ENV_RUNNABLE)
+		sched_enqueue(e);
+	sched_nlive += status_is_live(status) - status_is_live(old_status);
+	assert(sched_nlive >= 0);
+	spin_unlock(&sched_lock);
+}
+
+// Move e to priority level 'prio', requeueing it if it is runnable.
+// The caller must hold sched_lock.
+static void
+runq_set_prio(struct Env *e, int prio)
+{
+	bool queued = e->env_rq_cpu >= 0;
+
+	if (queued)
+		sched_dequeue(e);
+	e->env_prio = prio;
+	if (queued)
+		sched_enqueue(e);
+}
+
+void
+sched_set_prio(struct Env *e, int prio)
+{
+	spin_lock(&sched_lock);
+	runq_set_prio(e, prio);
+	spin_unlock(&sched_lock);
+}
+
+// e is about to block in IPC before using up its timeslice: treat it
+// as interactive and raise it one level.
+void
+sched_boost_env(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	if (!e->env_prio_pinned && e->env_prio > 0)
+		runq_set_prio(e, e->env_prio - 1);
+	spin_unlock(&sched_lock);
+}
+
+// Move every runnable or running env that is not pinned back to the
+// top level.  The caller must hold sched_lock.
+static void
+sched_boost_all(void)
+{
+	int i, prio;
+	struct Env *e, *next;
+
+	for (i = 0; i < ncpu; i++) {
+		for (prio = 1; prio < ENV_NPRIO; prio++) {
+			for (e = runqs[i].rq_head[prio]; e; e = next) {
+				next = e->env_rq_next;
+				if (!e->env_prio_pinned)
+					runq_set_prio(e, 0);
+			}
+		}
+		if ((e = cpus[i].cpu_env) && !e->env_prio_pinned)
+			e->env_prio = 0;
+	}
+}
+
+// Work stealing: find the busiest sibling of 'cpu' and take one env off
+// its run queue.  Prefer an env that is cache-cold (never ran, or has not
+// run for SCHED_HOT_CYCLES), since moving it costs nothing; otherwise take
+// the one deepest in the scanned part of the queue, which would wait the
+// longest on its own CPU.  Levels are scanned from the highest priority
+// down.  Returns NULL if no sibling is worth robbing.
+static struct Env *
+sched_steal(int cpu)
+{
+	struct RunQueue *victim = NULL;
+	struct Env *e, *pick = NULL;
+	uint64_t now;
+	int i, n, prio;
+
+	spin_lock(&sched_lock);
+	for (i = 0; i < ncpu; i++) {
+		struct RunQueue *rq = &runqs[i];
+		bool busy;
+
+		if (i == cpu || rq->rq_len == 0)
+			continue;
+		busy = cpus[i].cpu_status != CPU_HALTED && cpus[i].cpu_env;
+		if (busy && rq->rq_len < SCHED_STEAL_THRESHOLD)
+			continue;
+		if (!victim || rq->rq_len > victim->rq_len)
+			victim = rq;
+	}
+	if (!victim) {
+		spin_unlock(&sched_lock);
+		return NULL;
+	}
+
+	now = read_tsc();
+	n = 0;
+	for (prio = 0; prio < ENV_NPRIO && n < SCHED_STEAL_SCAN; prio++) {
+		for (e = victim->rq_head[prio]; e && n < SCHED_STEAL_SCAN;
+		     e = e->env_rq_next, n++) {
+			pick = e;
+			if (e->env_runs == 0 ||
+			    now - e->env_last_tsc >= SCHED_HOT_CYCLES)
+				goto found;
+		}
+	}
+found:
+	runqs[cpu].rq_steals++;
+	if (pick->env_runs > 0)
+		runqs[cpu].rq_migrations++;
+	spin_unlock(&sched_lock);
+	return pick;
+}
+
+// Print per-CPU run queue lengths and load balancer counters.
+void
+sched_print_stats(void)
+{
+	int i, prio;
+
+	spin_lock(&sched_lock);
+	cprintf("live envs: %d\n", sched_nlive);
+	cprintf("cpu  queued  by level    steals  migrations     halts\n");
+	for (i = 0; i < ncpu; i++) {
+		cprintf("%3d  %6d ", i, runqs[i].rq_len);
+		for (prio = 0; prio < ENV_NPRIO; prio++) {
+			int n = 0;
+			struct Env *e;
+			for (e = runqs[i].rq_head[prio]; e; e = e->env_rq_next)
+				n++;
+			cprintf(" %2d", n);
+		}
+		cprintf("  %8u  %10u  %8u\n", runqs[i].rq_steals,
+			runqs[i].rq_migrations, runqs[i].rq_halts);
+	}
+	spin_unlock(&sched_lock);
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
+	struct Env *e;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	// Take the first env on the highest non-empty level of this CPU's
+	// queue: env_run() removes it and puts the env we were running
+	// back on the tail of its own level.
 	//
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
+	// choose that environment.
 	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	for (int i = 1; i <= NENV; i++) {
-		int envid = (ENVX(curenv ? curenv->env_id : 0) + i) % NENV;
-		if (envs[envid].env_status == ENV_RUNNABLE) {
-			env_run(&envs[envid]);
-			assert(false);
-		}
+	// Envs running on other CPUs are ENV_RUNNING and thus never on
+	// a run queue.  If there are no runnable environments, simply
+	// drop through to the code below to halt the cpu.
+	//
+	// Hold env_lock from the pick until env_run() has marked the env
+	// ENV_RUNNING, so no other CPU can pick it too.
+	spin_lock(&env_lock);
+	spin_lock(&sched_lock);
+	e = runq_first(&runqs[cpunum()]);
+	spin_unlock(&sched_lock);
+	if (e) {
+		env_run(e);
+		assert(false);
 	}
-	if (curenv && curenv->env_status == ENV_RUNNING) 
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		spin_unlock(&env_lock);
 		env_run(curenv);
+	}
 
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Called on every timer interrupt instead of sched_yield().  The env we
+// interrupted used up its whole timeslice, so it drops one level; it
+// keeps the CPU only if it still outranks everything queued here.
+void
+sched_tick(void)
+{
+	struct Env *e = curenv, *next;
+
+	spin_lock(&sched_lock);
+	if (cpunum() == 0 && ++sched_boost_ticks >= SCHED_BOOST_TICKS) {
+		sched_boost_ticks = 0;
+		sched_boost_all();
+	}
+
+	if (e && e->env_status == ENV_RUNNING) {
+		if (!e->env_prio_pinned && e->env_prio < ENV_NPRIO - 1)
+			e->env_prio++;
+		next = runq_first(&runqs[cpunum()]);
+		if (!next || e->env_prio < next->env_prio) {
+			spin_unlock(&sched_lock);
+			env_run(e);
+		}
+	}
+	spin_unlock(&sched_lock);
+	sched_yield();
+}
+
+// Halt this CPU when there is nothing to do, unless a busy sibling
+// has work to spare.  Wait until the timer interrupt wakes it up.
+// Called with env_lock held, which is released.
+// This function never returns.
 //
 void
 sched_halt(void)
 {
-	int i;
+	struct Env *e;
+
+	// Rather than idle until our next timer tick, pull work over
+	// from the most loaded sibling.
+	if ((e = sched_steal(cpunum())) != NULL) {
+		env_run(e);
+		assert(false);
+	}
+
+	// Mark that no environment is running on this CPU.  Anything
+	// still here is a zombie that another CPU asked us to free.
+	if (curenv)
+		env_deschedule(ENV_RUNNABLE);
+	lcr3(PADDR(kern_pgdir));
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
-	}
-	if (i == NENV) {
+	if (sched_nlive == 0) {
+		spin_unlock(&env_lock);
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
+	runqs[cpunum()].rq_halts++;
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
-
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state, so that the load
+	// balancer knows it has nothing running
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	spin_unlock(&env_lock);
+
+	// Put the idle time to use before halting.
+	page_zero_idle();
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -91,4 +393,3 @@ sched_halt(void)
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
 }
-
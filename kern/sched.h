@@ -6,7 +6,20 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+// Run queue maintenance, called by env_set_status() after every
+// env_status transition.
+void sched_note_status(struct Env *e, unsigned old_status);
+
+// Multi-level feedback queue hooks.
+void sched_tick(void) __attribute__((noreturn));
+void sched_set_prio(struct Env *e, int prio);
+void sched_boost_env(struct Env *e);
+
+void sched_print_stats(void);
+
 #endif	// !JOS_KERN_SCHED_H
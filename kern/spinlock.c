@@ -8,13 +8,18 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/tlb.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
+// MCS queue nodes available to each CPU.  A CPU needs one per MCS lock
+// it holds or is waiting for, so this bounds how deeply they nest.
+#define MCS_NODES_PER_CPU	4
+
+static struct mcs_node mcs_nodes[NCPU][MCS_NODES_PER_CPU];
+
+#ifdef SPINLOCK_STATS
+// Every lock that has been acquired at least once, for lockstat.
+static struct spinlock *spin_stat_list;
 #endif
-};
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -46,13 +51,119 @@ holding(struct spinlock *lock)
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	memset(lk, 0, sizeof(*lk));
 	lk->name = name;
-	lk->cpu = 0;
-#endif
+	lk->type = SPINLOCK_TICKET;
+}
+
+// Take a ticket and wait for it to come up.
+// Returns true, with the cycles waited in *spin, if we had to wait.
+static bool
+ticket_acquire(struct spinlock *lk, uint64_t *spin)
+{
+	uint32_t ticket = xadd(&lk->next_ticket, 1);
+	uint64_t start;
+
+	if (lk->now_serving == ticket)
+		return false;
+	start = read_tsc();
+	while (lk->now_serving != ticket) {
+		// The holder may be waiting for us to flush our TLB
+		tlb_shootdown_poll();
+		asm volatile ("pause");
+	}
+	*spin = read_tsc() - start;
+	return true;
+}
+
+static void
+ticket_release(struct spinlock *lk)
+{
+	// Only the holder writes now_serving, so no locked
+	// instruction is needed.
+	lk->now_serving = lk->now_serving + 1;
+}
+
+// Find a free queue node in this CPU's pool.
+static struct mcs_node *
+mcs_node_alloc(struct spinlock *lk)
+{
+	struct mcs_node *node = mcs_nodes[cpunum()];
+	int i;
+
+	for (i = 0; i < MCS_NODES_PER_CPU; i++, node++)
+		if (!node->lock) {
+			node->lock = lk;
+			return node;
+		}
+	panic("CPU %d cannot acquire %s: out of MCS nodes", cpunum(), lk->name);
 }
 
+// Join the tail of the queue and, unless the lock was free, spin on
+// our own node until our predecessor hands the lock to us.
+// Returns true, with the cycles waited in *spin, if we had to wait.
+static bool
+mcs_acquire(struct spinlock *lk, uint64_t *spin)
+{
+	struct mcs_node *node = mcs_node_alloc(lk), *pred;
+	uint64_t start;
+
+	node->next = NULL;
+	node->waiting = 1;
+	pred = (struct mcs_node *) xchg((volatile uint32_t *) &lk->mcs_tail,
+					(uint32_t) node);
+	if (!pred) {
+		lk->mcs_holder = node;
+		return false;
+	}
+
+	start = read_tsc();
+	pred->next = node;
+	while (node->waiting) {
+		tlb_shootdown_poll();
+		asm volatile ("pause");
+	}
+	*spin = read_tsc() - start;
+	lk->mcs_holder = node;
+	return true;
+}
+
+static void
+mcs_release(struct spinlock *lk)
+{
+	struct mcs_node *node = lk->mcs_holder;
+
+	if (!node->next) {
+		// Nobody queued behind us: try to mark the lock free.
+		if (cmpxchg((volatile uint32_t *) &lk->mcs_tail,
+			    (uint32_t) node, 0) == (uint32_t) node)
+			goto done;
+		// Somebody is between the xchg and linking in; wait.
+		while (!node->next)
+			asm volatile ("pause");
+	}
+	node->next->waiting = 0;
+done:
+	node->lock = NULL;
+}
+
+#ifdef SPINLOCK_STATS
+// Put lk on the list that lockstat walks.  Called by the holder the
+// first time it is acquired.
+static void
+spin_stat_register(struct spinlock *lk)
+{
+	struct spinlock *head;
+
+	lk->stat_registered = 1;
+	do {
+		head = spin_stat_list;
+		lk->stat_next = head;
+	} while (cmpxchg((volatile uint32_t *) &spin_stat_list,
+			 (uint32_t) head, (uint32_t) lk) != (uint32_t) head);
+}
+#endif
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 // Holding a lock for a long time may cause
@@ -60,16 +171,38 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint64_t spin = 0;
+	bool contended __attribute__((unused));
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// Both acquire paths end in a locked instruction or a read of a
+	// value written by the previous holder after its critical section,
+	// and x86 doesn't reorder loads with other loads, so reads in our
+	// critical section can't see stale data.  The barrier keeps gcc
+	// from moving them up, too.
+	if (lk->type == SPINLOCK_MCS)
+		contended = mcs_acquire(lk, &spin);
+	else
+		contended = ticket_acquire(lk, &spin);
+	asm volatile ("" : : : "memory");
+	lk->locked = 1;
+
+#ifdef SPINLOCK_STATS
+	// We hold the lock, so the statistics are ours to update.
+	lk->acquires++;
+	if (contended) {
+		lk->contended++;
+		lk->spin_cycles += spin;
+		if (spin > lk->max_spin_cycles)
+			lk->max_spin_cycles = spin;
+	}
+	if (!lk->stat_registered)
+		spin_stat_register(lk);
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -107,10 +240,55 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
-	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
-	// respect to any other instruction which references the same memory.
-	// x86 CPUs will not reorder loads/stores across locked instructions
-	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+	// x86 CPUs do not reorder stores with earlier loads or stores
+	// (vol 3, 8.2.2), so the store that hands the lock on is seen after
+	// everything we did under it.  The barrier keeps gcc from sinking
+	// our critical section past it.
+	lk->locked = 0;
+	asm volatile ("" : : : "memory");
+	if (lk->type == SPINLOCK_MCS)
+		mcs_release(lk);
+	else
+		ticket_release(lk);
+}
+
+// Print the contention statistics of every lock acquired so far.
+// Locks sharing a name, such as the per-env VM locks, are summed.
+void
+spin_print_stats(void)
+{
+#ifdef SPINLOCK_STATS
+	struct spinlock *lk, *other;
+
+	cprintf("%-14s %-6s %5s %10s %10s %12s %12s\n", "lock", "type",
+		"count", "acquires", "contended", "avg spin", "max spin");
+	for (lk = spin_stat_list; lk; lk = lk->stat_next) {
+		uint64_t acquires = 0, contended = 0, spin = 0, max = 0;
+		int n = 0;
+
+		// Only print a name at its first lock on the list.
+		for (other = spin_stat_list; other != lk; other = other->stat_next)
+			if (strcmp(other->name, lk->name) == 0)
+				break;
+		if (other != lk)
+			continue;
+
+		for (other = lk; other; other = other->stat_next) {
+			if (strcmp(other->name, lk->name) != 0)
+				continue;
+			n++;
+			acquires += other->acquires;
+			contended += other->contended;
+			spin += other->spin_cycles;
+			if (other->max_spin_cycles > max)
+				max = other->max_spin_cycles;
+		}
+		cprintf("%-14s %-6s %5d %10llu %10llu %12llu %12llu\n",
+			lk->name, lk->type == SPINLOCK_MCS ? "mcs" : "ticket",
+			n, acquires, contended,
+			contended ? spin / contended : 0ULL, max);
+	}
+#else
+	cprintf("lock statistics are not compiled in (SPINLOCK_STATS)\n");
+#endif
 }
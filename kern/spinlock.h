@@ -3,46 +3,73 @@
 
 #include <inc/types.h>
 
-// Comment this to disable spinlock debugging
-#define DEBUG_SPINLOCK
+// Uncomment this to enable spinlock debugging, which records the
+// holder and its call stack on every acquire
+// #define DEBUG_SPINLOCK
+
+// Comment this to disable the contention statistics shown by lockstat
+#define SPINLOCK_STATS
+
+// Lock algorithms, chosen per lock.  Both hand the lock over in FIFO
+// order.  A ticket lock has every waiter spin on the lock itself; an MCS
+// lock queues waiters so that each spins on its own cache line, which
+// scales better for locks that many CPUs fight over.
+enum {
+	SPINLOCK_TICKET = 0,
+	SPINLOCK_MCS,
+};
+
+// An MCS waiter.  Each CPU has a small pool of these, one for every
+// MCS lock it may hold or wait for at the same time.
+struct mcs_node {
+	struct mcs_node *volatile next;	// Next waiter in the queue
+	volatile unsigned waiting;	// Cleared by our predecessor
+	struct spinlock *lock;		// Lock using this node, or NULL
+} __attribute__((aligned(64)));
 
 // Mutual exclusion lock.
 struct spinlock {
 	unsigned locked;       // Is the lock held?
+	char *name;            // Name of lock.
+	int type;              // SPINLOCK_TICKET or SPINLOCK_MCS
+
+	// Ticket lock: take the next ticket, wait until it is served
+	volatile uint32_t next_ticket;
+	volatile uint32_t now_serving;
+
+	// MCS lock: the last waiter in the queue, and the holder's node
+	struct mcs_node *volatile mcs_tail;
+	struct mcs_node *mcs_holder;
+
+#ifdef SPINLOCK_STATS
+	// Contention statistics, updated by the holder
+	uint64_t acquires;          // Times acquired
+	uint64_t contended;         // Times the acquirer had to wait
+	uint64_t spin_cycles;       // Total cycles spent waiting
+	uint64_t max_spin_cycles;   // Longest single wait
+	struct spinlock *stat_next; // Next lock lockstat knows about
+	bool stat_registered;
+#endif
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
 };
 
+// Static initializers
+#define SPINLOCK_INIT(lockname) \
+	{ .name = (lockname), .type = SPINLOCK_TICKET }
+#define MCS_SPINLOCK_INIT(lockname) \
+	{ .name = (lockname), .type = SPINLOCK_MCS }
+
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_print_stats(void);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
-
 #endif
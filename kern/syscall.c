@@ -4,6 +4,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/batch.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -14,6 +15,28 @@
 #include <kern/time.h>
 #include <kern/e1000.h>
 #include <kern/spinlock.h>
+#include <kern/mbox.h>
+#include <kern/futex.h>
+
+// Look up envid as envid2env() does and lock its address space.  Once
+// the VM lock is held the env can't be freed, so env_lock is only needed
+// for the lookup, and not at all when envid names the caller.
+static int
+envid2env_vm(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	int r;
+
+	if (envid == 0 || envid == curenv->env_id) {
+		*env_store = curenv;
+		env_vm_lock(curenv);
+		return 0;
+	}
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, env_store, checkperm)) == 0)
+		env_vm_lock(*env_store);
+	spin_unlock(&env_lock);
+	return r;
+}
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -25,10 +48,16 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
-	user_mem_assert(curenv, s, len, 0);
+	// Hold our VM lock so the string can't be unmapped under us.
+	env_vm_lock(curenv);
+	if (user_mem_check(curenv, s, len, PTE_U) < 0) {
+		env_vm_unlock(curenv);
+		user_mem_assert(curenv, s, len, 0);
+	}
 
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
+	env_vm_unlock(curenv);
 }
 
 // Read a character from the system console without blocking.
@@ -57,8 +86,11 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &e, 1)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
+	}
 	env_destroy(e);
 	return 0;
 }
@@ -87,16 +119,117 @@ sys_exofork(void)
 	// panic("sys_exofork not implemented");
 	int r;
 	struct Env *env = NULL;
-	if ((r = env_alloc(&env, curenv->env_id)) < 0) 
+	spin_lock(&env_lock);
+	if ((r = env_alloc(&env, curenv->env_id)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
+	}
 
-	env->env_status = ENV_NOT_RUNNABLE;
+	// env_alloc() already left it ENV_NOT_RUNNABLE
 	env->env_tf = curenv->env_tf;
 	env->env_brk = curenv->env_brk;
 	env->env_tf.tf_regs.reg_eax = 0;  // return 0 in new env's sys_exofork
+	spin_unlock(&env_lock);
 	return env->env_id;
 }
 
+// Create a copy-on-write child of the current environment, as fork()
+// in lib/fork.c once did with sys_exofork and a sys_page_map per page,
+// but in one pass over our page tables.  If 'share', the child instead
+// shares every page below our stack, for sfork().  The child gets a
+// fresh user exception stack and our page fault upcall.  It is left
+// runnable, and sys_fork returns 0 in it.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(bool share)
+{
+	struct Env *env = NULL;
+	struct PageInfo *pp = NULL;
+	envid_t envid;
+	int r;
+
+	// Zero the child's exception stack before taking any lock
+	if (curenv->env_pgfault_upcall && !(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+
+	spin_lock(&env_lock);
+	if ((r = env_alloc(&env, curenv->env_id)) < 0) {
+		spin_unlock(&env_lock);
+		if (pp)
+			page_free(pp);
+		return r;
+	}
+
+	// env_alloc() already left it ENV_NOT_RUNNABLE
+	envid = env->env_id;
+	env->env_tf = curenv->env_tf;
+	env->env_brk = curenv->env_brk;
+	env->env_tf.tf_regs.reg_eax = 0;  // return 0 in new env's sys_fork
+	env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	env_vm_lock_pair(curenv, env);
+	spin_unlock(&env_lock);
+
+	r = 0;
+	if (pp && (r = user_page_insert(env, pp, (void *) (UXSTACKTOP - PGSIZE),
+					PTE_U | PTE_W | PTE_P)) == 0)
+		pp = NULL;
+	if (r == 0)
+		r = user_vm_fork(curenv, env, share);
+	env_vm_unlock_pair(curenv, env);
+
+	spin_lock(&env_lock);
+	if (r == 0)
+		env_set_status(env, ENV_RUNNABLE);
+	else
+		env_free(env);
+	spin_unlock(&env_lock);
+	if (pp)
+		page_free(pp);
+	return r < 0 ? r : envid;
+}
+
+// Load the ELF binary whose file pages we map at 'image', page i of
+// the file at image + i*PGSIZE for i < npages, into envid, a child of
+// ours that we have yet to start.  See env_load_elf() in kern/env.c:
+// the pages are mapped into the child rather than copied.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is running or is the caller, or the image
+//		is not page-aligned or not below UTOP.
+//	-E_NOT_EXEC if the image is not a valid ELF binary.
+//	-E_NO_MEM on memory exhaustion.
+static int
+sys_env_load_elf(envid_t envid, void *image, size_t npages)
+{
+	struct Env *env;
+	int r;
+
+	if ((uintptr_t) image >= UTOP || (uintptr_t) image % PGSIZE ||
+	    npages > (UTOP - (uintptr_t) image) / PGSIZE)
+		return -E_INVAL;
+
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &env, true)) < 0) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+	if (env == curenv || env->env_status != ENV_NOT_RUNNABLE) {
+		spin_unlock(&env_lock);
+		return -E_INVAL;
+	}
+	env_vm_lock_pair(curenv, env);
+	spin_unlock(&env_lock);
+
+	r = env_load_elf(env, curenv, (uintptr_t) image, npages);
+	env_vm_unlock_pair(curenv, env);
+	return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -104,6 +237,10 @@ sys_exofork(void)
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if status is not a valid status for an environment.
+//	-E_INVAL if status is ENV_NOT_RUNNABLE and envid is running on
+//		another CPU, which we have no way to stop.
+//	-E_INVAL if envid is blocked in IPC or sleeping on a futex,
+//		where only its peer, a futex wake or its timeout may wake it.
 static int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -117,13 +254,70 @@ sys_env_set_status(envid_t envid, int status)
 	// panic("sys_env_set_status not implemented");
 	int r;
 	struct Env *env = NULL;
+	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE) 
+		return -E_INVAL;
+
+	spin_lock(&env_lock);
 	if ((r = envid2env(envid, &env, true)) < 0) 
-		return r;
+		goto out;
 
-	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE) 
+	r = 0;
+	if (env->env_status == ENV_DYING)
+		r = -E_BAD_ENV;
+	else if (env->env_ipc_sending || env->env_ipc_recving)
+		// It is on its target's sender queue, or a sender may
+		// find it: waking it here would leave it there
+		r = -E_INVAL;
+	else if (env->env_futex_waiting)
+		// Likewise for its futex chain
+		r = -E_INVAL;
+	else if (env->env_status != ENV_RUNNING)
+		env_set_status(env, status);
+	else if (status == ENV_NOT_RUNNABLE && env != curenv)
+		r = -E_INVAL;
+	else if (status == ENV_NOT_RUNNABLE) {
+		// Stopping ourselves: once descheduled we may be woken
+		// and run elsewhere, so set our return value first.
+		env->env_tf.tf_regs.reg_eax = 0;
+		env_deschedule(ENV_NOT_RUNNABLE);
+		spin_unlock(&env_lock);
+		sched_yield();
+	}
+out:
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Set envid's scheduling priority.  'prio' is a level between
+// ENV_PRIO_HIGH and ENV_PRIO_LOW, which pins the env there so the
+// scheduler's feedback rules no longer move it, or ENV_PRIO_AUTO, which
+// unpins it.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is not a valid priority.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	int r;
+	struct Env *env = NULL;
+	if (prio != ENV_PRIO_AUTO && (prio < ENV_PRIO_HIGH || prio > ENV_PRIO_LOW)) 
 		return -E_INVAL;
-	
-	env->env_status = status;
+
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &env, true)) < 0) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+
+	if (prio == ENV_PRIO_AUTO) 
+		env->env_prio_pinned = 0;
+	else {
+		env->env_prio_pinned = 1;
+		sched_set_prio(env, prio);
+	}
+	spin_unlock(&env_lock);
 	return 0;
 }
 
@@ -143,8 +337,11 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// panic("sys_env_set_trapframe not implemented");
 	int r;
 	struct Env *env = NULL;
-	if ((r = envid2env(envid, &env, true)) < 0) 
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &env, true)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
+	}
 
 	env->env_tf = *tf;
 	env->env_tf.tf_ds = GD_UD | 3;
@@ -153,6 +350,7 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	env->env_tf.tf_cs = GD_UT | 3;
 	env->env_tf.tf_eflags |= FL_IF;
 	env->env_tf.tf_eflags = (env->env_tf.tf_eflags & ~FL_IOPL_MASK) | FL_IOPL_0;
+	spin_unlock(&env_lock);
 	return 0;
 }
 
@@ -171,10 +369,14 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	// panic("sys_env_set_pgfault_upcall not implemented");
 	int r;
 	struct Env *env = NULL;
-	if ((r = envid2env(envid, &env, true)) < 0) 
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &env, true)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
+	}
 
 	env->env_pgfault_upcall = func;
+	spin_unlock(&env_lock);
 	return 0;
 }
 
@@ -208,38 +410,70 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	// panic("sys_page_alloc not implemented");
 	int r;
 	struct Env *env = NULL;
-	if ((r = envid2env(envid, &env, true)) < 0) 
+	struct PageInfo *pp;
+	if ((r = envid2env_vm(envid, &env, true)) < 0) 
 		return r;
 
+	r = -E_INVAL;
 	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PGSIZE) 
-		return -E_INVAL;
+		goto out;
 
 	if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P)) 
-		return -E_INVAL;
+		goto out;
 
-	struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+	r = -E_NO_MEM;
+	pp = page_alloc(ALLOC_ZERO);
 	if (pp == NULL) 
-		return -E_NO_MEM;
+		goto out;
 
-	if ((r = page_insert(env->env_pgdir, pp, va, perm)) < 0) {
+	if ((r = user_page_insert(env, pp, va, perm)) < 0)
 		page_free(pp);
-		return r;
-	}
+out:
+	env_vm_unlock(env);
+	return r;
+}
 
-	if ((r = page_insert(env->env_kern_pgdir, pp, va, perm)) < 0) {
-		page_remove(env->env_pgdir, va);
-		page_free(pp);
+// Allocate a 4MB large page of physically contiguous memory and map it
+// at 'va' in the address space of 'envid' with a single PTE_PS directory
+// entry, so that the whole range takes one TLB entry.
+// The page's contents are set to 0.
+// If a large page is already mapped at 'va', it is unmapped as a side
+// effect.  sys_page_unmap of any address in the large page unmaps all
+// of it; sys_page_map of its first address shares it.
+//
+// perm -- as for sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not 4MB-aligned.
+//	-E_INVAL if 4KB pages are mapped in [va, va + 4MB).
+//	-E_INVAL if perm is inappropriate.
+//	-E_NO_MEM if there's no free 4MB block of memory.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	int r;
+	struct Env *env = NULL;
+	struct PageInfo *pp;
+
+	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PTSIZE) 
+		return -E_INVAL;
+	if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P)) 
+		return -E_INVAL;
+
+	// Zero the 4MB before taking the env's VM lock
+	if (!(pp = page_alloc_contig(BUDDY_MAX_ORDER, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((r = envid2env_vm(envid, &env, true)) < 0) {
+		page_free_contig(pp, BUDDY_MAX_ORDER);
 		return r;
 	}
 
-	struct PageInfo *upp = page_lookup(env->env_pgdir, va, NULL);
-	struct PageInfo *kpp = page_lookup(env->env_kern_pgdir, va, NULL);
-	assert(upp != NULL);
-	assert(kpp != NULL);
-	assert(upp->pp_ref == 2 && kpp->pp_ref == 2);
-	assert(upp == kpp);
-		
-	return 0;
+	if ((r = user_page_insert_large(env, pp, va, perm)) < 0)
+		page_free_contig(pp, BUDDY_MAX_ORDER);
+	env_vm_unlock(env);
+	return r;
 }
 
 // Map the page of memory at 'srcva' in srcenvid's address space
@@ -257,6 +491,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is in a large page and srcva or dstva is not
+//		4MB-aligned, or dstva's 4MB range can't take a large page
+//		(see sys_page_alloc_large).
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -274,41 +511,57 @@ sys_page_map(envid_t srcenvid, void *srcva,
     int r;
 	struct Env *srcenv = NULL;
 	struct Env *dstenv = NULL;
-	if ((r = envid2env(srcenvid, &srcenv, true)) < 0) 
-		return r;
+	pte_t *pte = NULL;
+	struct PageInfo *srcpp;
+	int (*insert)(struct Env *, struct PageInfo *, void *, int) = user_page_insert;
 
-	if ((r = envid2env(dstenvid, &dstenv, true)) < 0) 
+	// Both envs stay allocated once their VM locks are held.
+	spin_lock(&env_lock);
+	if ((r = envid2env(srcenvid, &srcenv, true)) < 0 ||
+	    (r = envid2env(dstenvid, &dstenv, true)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
+	}
+	env_vm_lock_pair(srcenv, dstenv);
+	spin_unlock(&env_lock);
 
+	r = -E_INVAL;
 	if ((uintptr_t)srcva >= UTOP || (uintptr_t)srcva % PGSIZE ||
 		(uintptr_t)dstva >= UTOP || (uintptr_t)dstva % PGSIZE)
-		return -E_INVAL;
+		goto out;
 
-	pte_t *pte = NULL;
-	struct PageInfo *srcpp = page_lookup(srcenv->env_pgdir, srcva, &pte);
+	srcpp = page_lookup(srcenv->env_pgdir, srcva, &pte);
 	if (srcpp == NULL) 
-		return -E_INVAL;
+		goto out;
 
-	if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P) ||
-		(!(*pte | PTE_W) && (perm & PTE_W)))
-		return -E_INVAL;
-
-	if ((r = page_insert(dstenv->env_pgdir, srcpp, dstva, perm)) < 0) {
-		page_free(srcpp);
-		return r;
+	// A large page is mapped whole, from its first address
+	if (*pte & PTE_PS) {
+		if ((uintptr_t)srcva % PTSIZE || (uintptr_t)dstva % PTSIZE)
+			goto out;
+		insert = user_page_insert_large;
 	}
 
-	if ((r = page_insert(dstenv->env_kern_pgdir, srcpp, dstva, perm)) < 0) {
-		page_remove(dstenv->env_pgdir, dstva);
-		page_free(srcpp);
-		return r;
+	if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P))
+		goto out;
+	// As in ipc_map_page, break copy-on-write before sharing writable
+	if ((perm & PTE_W) && (*pte & PTE_COW) && !(*pte & PTE_PS)) {
+		if ((r = user_page_cow(srcenv, srcva)) < 0)
+			goto out;
+		srcpp = page_lookup(srcenv->env_pgdir, srcva, &pte);
+		r = -E_INVAL;
 	}
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		goto out;
 
-	return 0;
+	r = insert(dstenv, srcpp, dstva, perm);
+out:
+	env_vm_unlock_pair(srcenv, dstenv);
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
+// If 'va' is in a large page, all 4MB of it are unmapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -323,32 +576,300 @@ sys_page_unmap(envid_t envid, void *va)
 	// panic("sys_page_unmap not implemented");
 	int r;
 	struct Env *env = NULL;
-	if ((r = envid2env(envid, &env, true)) < 0) 
+	if ((r = envid2env_vm(envid, &env, true)) < 0) 
 		return r;
 
-	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PGSIZE) 
+	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PGSIZE) {
+		env_vm_unlock(env);
+		return -E_INVAL;
+	}
+
+	user_page_remove(env, va);
+	env_vm_unlock(env);
+	return 0;
+}
+
+// Look up the page at 'srcva' in src to send in an IPC, checking
+// 'srcva' and 'perm' as sys_ipc_try_send documents.  The caller holds
+// src's VM lock.
+static int
+ipc_page_lookup(struct Env *src, void *srcva, unsigned perm,
+		struct PageInfo **pp_store)
+{
+	int r;
+	pte_t *pte = NULL;
+	struct PageInfo *pp;
+
+	if ((uintptr_t)srcva % PGSIZE) 
+		return -E_INVAL;
+	if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P)) 
+		return -E_INVAL;
+
+	pp = page_lookup(src->env_pgdir, srcva, &pte);
+	if (pp == NULL)
+		return -E_INVAL;
+	// Large pages can be shared with sys_page_map, not sent
+	if (*pte & PTE_PS)
+		return -E_INVAL;
+	// A copy-on-write page, lazy BSS included, is the sender's to
+	// write: give it its own copy before sharing that writable
+	if ((perm & PTE_W) && (*pte & PTE_COW)) {
+		if ((r = user_page_cow(src, srcva)) < 0)
+			return r;
+		pp = page_lookup(src->env_pgdir, srcva, &pte);
+	}
+	if ((perm & PTE_W) && !(*pte & PTE_W)) 
+		return -E_INVAL;
+	*pp_store = pp;
+	return 0;
+}
+
+// Map the page at 'srcva' in src at 'dstva' in dst for an IPC.
+// The caller holds env_lock, which keeps both envs from being freed.
+static int
+ipc_map_page(struct Env *src, void *srcva, struct Env *dst, void *dstva,
+	     unsigned perm)
+{
+	struct PageInfo *pp;
+	int r;
+
+	env_vm_lock_pair(src, dst);
+	if ((r = ipc_page_lookup(src, srcva, perm, &pp)) == 0)
+		r = user_page_insert(dst, pp, dstva, perm);
+	env_vm_unlock_pair(src, dst);
+	return r;
+}
+
+// Check a receive window of 'npages' pages at *dstva, as sys_ipc_recv
+// and sys_ipc_recvv take it.  A window at or above UTOP is no window,
+// and *dstva becomes NULL.
+static int
+ipc_check_window(void **dstva, size_t npages)
+{
+	if ((uintptr_t)*dstva >= UTOP) {
+		*dstva = NULL;
+		return 0;
+	}
+	if ((uintptr_t)*dstva % PGSIZE || npages == 0 || npages > IPC_MAXPAGES ||
+	    npages > (UTOP - (uintptr_t)*dstva) / PGSIZE)
+		return -E_INVAL;
+	return 0;
+}
+
+// Map what 'src' is sending into dst's receive window: the ranges of
+// its vector, back to back, if it made a vectored send, or else the
+// page at 'srcva' if srcva < UTOP.  Nothing is mapped if dst asked for
+// no pages; if it did, every page is mapped or none is.  Sets dst's
+// env_ipc_npages, and env_ipc_perm to the perm of the first page.
+// The caller holds env_lock.
+static int
+ipc_transfer(struct Env *src, void *srcva, unsigned perm, struct Env *dst)
+{
+	char *dstva = dst->env_ipc_dstva;
+	struct IpcVec *iv, *vend = src->env_ipc_vec + src->env_ipc_nvec;
+	struct PageInfo *pp;
+	size_t i, n = 0;
+	int r = 0;
+
+	dst->env_ipc_perm = 0;
+	dst->env_ipc_npages = 0;
+	if (dstva == NULL)
+		return 0;
+	if (src->env_ipc_nvec == 0) {
+		if (srcva == NULL || (uintptr_t)srcva >= UTOP)
+			return 0;
+		if ((r = ipc_map_page(src, srcva, dst, dstva, perm)) < 0)
+			return r;
+		dst->env_ipc_perm = perm;
+		dst->env_ipc_npages = 1;
+		return 0;
+	}
+
+	for (iv = src->env_ipc_vec; iv < vend; iv++)
+		n += iv->iv_npages;
+	if (n > dst->env_ipc_dstpages)
 		return -E_INVAL;
 
-	struct PageInfo *pp = page_lookup(env->env_pgdir, va, NULL);
-	assert (pp == page_lookup(env->env_kern_pgdir, va, NULL));
-	bool ass = false;
-	if (pp && pp->pp_ref == 2) {
-		ass = true;
-	}
-	if (ass) assert(pp->pp_ref == 2);
-	page_remove(env->env_pgdir, va);
-	if (ass) assert(pp->pp_ref == 1);
-	page_remove(env->env_kern_pgdir, va);
-	if (ass) assert(pp->pp_ref == 0);
+	env_vm_lock_pair(src, dst);
+	n = 0;
+	for (iv = src->env_ipc_vec; iv < vend && r == 0; iv++)
+		for (i = 0; i < iv->iv_npages; i++) {
+			if ((r = ipc_page_lookup(src, (char *)iv->iv_va + i * PGSIZE,
+						 iv->iv_perm, &pp)) < 0 ||
+			    (r = user_page_insert(dst, pp, dstva + n * PGSIZE,
+						  iv->iv_perm)) < 0)
+				break;
+			n++;
+		}
+	if (r < 0) {
+		while (n > 0)
+			user_page_remove(dst, dstva + --n * PGSIZE);
+	} else {
+		dst->env_ipc_perm = src->env_ipc_vec[0].iv_perm;
+		dst->env_ipc_npages = n;
+	}
+	env_vm_unlock_pair(src, dst);
+	return r;
+}
+
+// Copy in the message of a vectored send by curenv, checking its
+// ranges, and return its value in *value_store.  Its vector goes in
+// curenv's env_ipc_vec, which the send clears once over.  A message
+// with no ranges carries no pages.
+static int
+ipc_copyin_msg(const struct IpcMsg *umsg, uint32_t *value_store)
+{
+	struct IpcMsg msg;
+	struct IpcVec *iv;
+	size_t n = 0;
+	int r;
+
+	env_vm_lock(curenv);
+	if ((r = user_mem_check(curenv, umsg, sizeof(msg), PTE_U)) == 0)
+		msg = *umsg;
+	env_vm_unlock(curenv);
+	if (r < 0)
+		return r;
+
+	if (msg.im_nvec < 0 || msg.im_nvec > IPC_VEC_MAX)
+		return -E_INVAL;
+	for (iv = msg.im_vec; iv < msg.im_vec + msg.im_nvec; iv++) {
+		if ((uintptr_t)iv->iv_va % PGSIZE || (uintptr_t)iv->iv_va >= UTOP ||
+		    iv->iv_npages > IPC_MAXPAGES - n ||
+		    iv->iv_npages > (UTOP - (uintptr_t)iv->iv_va) / PGSIZE)
+			return -E_INVAL;
+		n += iv->iv_npages;
+	}
+	memcpy(curenv->env_ipc_vec, msg.im_vec, msg.im_nvec * sizeof(struct IpcVec));
+	curenv->env_ipc_nvec = msg.im_nvec;
+	*value_store = msg.im_value;
 	return 0;
 }
 
+// Deliver a message from 'src' to 'dst', which is blocked receiving
+// at dst->env_ipc_dstva, as sys_ipc_try_send describes.  Leaves dst
+// blocked: the caller decides who runs next.  Either way src's send
+// is over.
+// The caller holds env_lock.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value, void *srcva, unsigned perm)
+{
+	int r;
+
+	r = ipc_transfer(src, srcva, perm, dst);
+	src->env_ipc_nvec = 0;
+	if (r < 0)
+		return r;
+	dst->env_ipc_recving = 0;
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
+	dst->env_tf.tf_regs.reg_eax = 0;
+	return 0;
+}
+
+// Block curenv until 'dst' takes its message: queue it behind dst's
+// other senders and give up the CPU.
+// Releases env_lock and does not return.
+static void __attribute__((noreturn))
+ipc_block_send(struct Env *dst, uint32_t value, void *srcva, unsigned perm)
+{
+	curenv->env_ipc_sending = 1;
+	sched_boost_env(curenv);
+	curenv->env_ipc_send_envid = dst->env_id;
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	env_ipc_enqueue(dst, curenv);
+	env_deschedule(ENV_NOT_RUNNABLE);
+	spin_unlock(&env_lock);
+	sched_yield();
+}
+
+// Take the oldest message in curenv's mailbox or, failing that, that
+// of the longest-waiting sender queued on it, as if curenv had been
+// receiving in the window of 'npages' pages at 'dstva' when it was
+// sent.  A sender that sent as part of sys_ipc_call now waits for its
+// reply.
+// Returns true if a message was taken.  The caller holds env_lock.
+static bool
+ipc_recv_queued(void *dstva, size_t npages)
+{
+	struct Env *sender;
+	struct MboxMsg msg;
+	int r;
+
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstpages = npages;
+	while (mbox_get(curenv, &msg)) {
+		r = 0;
+		if (msg.mm_page && dstva != NULL) {
+			env_vm_lock(curenv);
+			r = user_page_insert(curenv, msg.mm_page, dstva, msg.mm_perm);
+			env_vm_unlock(curenv);
+		} else {
+			msg.mm_perm = 0;
+		}
+		if (msg.mm_page)
+			page_decref(msg.mm_page);
+		// With nobody waiting on it, a message that can't be
+		// received is dropped
+		if (r < 0)
+			continue;
+
+		curenv->env_ipc_perm = msg.mm_perm;
+		curenv->env_ipc_npages = msg.mm_perm ? 1 : 0;
+		curenv->env_ipc_recving = 0;
+		curenv->env_ipc_from = msg.mm_from;
+		curenv->env_ipc_value = msg.mm_value;
+		return true;
+	}
+
+	while ((sender = curenv->env_ipc_senders) != NULL) {
+		r = ipc_transfer(sender, sender->env_ipc_srcva,
+				 sender->env_ipc_send_perm, curenv);
+
+		// Either way the sender's send is over
+		env_ipc_dequeue(curenv, sender);
+		sender->env_ipc_sending = 0;
+		sender->env_ipc_nvec = 0;
+		if (r == 0 && sender->env_ipc_calling) {
+			sender->env_ipc_recving = 1;
+		} else {
+			sender->env_tf.tf_regs.reg_eax = r;
+			env_set_status(sender, ENV_RUNNABLE);
+		}
+		sender->env_ipc_calling = 0;
+		if (r < 0)
+			continue;
+
+		curenv->env_ipc_recving = 0;
+		curenv->env_ipc_from = sender->env_id;
+		curenv->env_ipc_value = sender->env_ipc_send_value;
+		return true;
+	}
+	return false;
+}
+
+// Block curenv receiving and run 'dst', which was just handed a
+// message, on this CPU in its place, without a scheduler pass.
+// Releases env_lock and does not return.
+static void __attribute__((noreturn))
+ipc_handoff(struct Env *dst)
+{
+	curenv->env_ipc_recving = 1;
+	sched_boost_env(curenv);
+	env_deschedule(ENV_NOT_RUNNABLE);
+	env_set_status(dst, ENV_RUNNABLE);
+	env_run(dst);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
+// If the target is not blocked, waiting for an IPC, the caller blocks
+// until the target receives, behind any other envs already waiting to
+// send to it.
 //
 // The send also can fail for the other reasons listed below.
 //
@@ -368,10 +889,9 @@ sys_page_unmap(envid_t envid, void *va)
 //
 // Returns 0 on success, < 0 on error.
 // Errors are:
-//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or exits before receiving.
 //		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -388,52 +908,74 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	// panic("sys_ipc_try_send not implemented");
 	int r;
 	struct Env *env = NULL;
-	if ((r = envid2env(envid, &env, false)) < 0) 
-		panic("envid2env: %e", r);
-
-	if (env->env_ipc_recving == 0) { 
-		// return -E_IPC_NOT_RECV;
-		// not waked up until received
-		curenv->env_ipc_sending = 1;
-		curenv->env_status = ENV_NOT_RUNNABLE;
-		curenv->env_ipc_send_envid = envid;
-		curenv->env_ipc_send_value = value;
-		curenv->env_ipc_srcva = srcva;
-		curenv->env_ipc_send_perm = perm;
-		sched_yield();
-		return 0;
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &env, false)) < 0) {
+		spin_unlock(&env_lock);
+		return r;
 	}
 
-	if (srcva != NULL && (uintptr_t)srcva < UTOP && env->env_ipc_dstva != NULL &&
-		(uintptr_t)env->env_ipc_dstva < UTOP) {
-		if ((uintptr_t)srcva % PGSIZE) 
-			return -E_INVAL;
-		if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P)) 
-			return -E_INVAL;
-		pte_t *pte = NULL;
-		struct PageInfo *pp = page_lookup(curenv->env_pgdir, srcva, &pte);
-		if (pp == NULL)
-			return -E_INVAL;
-		if ((perm & PTE_W) && !(*pte & PTE_W)) 
-			return -E_INVAL;		
-		if ((r = page_insert(env->env_pgdir, pp, env->env_ipc_dstva, perm)) < 0) 
-			return r;
-		if ((r = page_insert(env->env_kern_pgdir, pp, env->env_ipc_dstva, perm)) < 0) {
-			page_remove(env->env_pgdir, env->env_ipc_dstva);
-			return r;
-		}
-		env->env_ipc_perm = perm;
-	} else{
-		env->env_ipc_perm = 0;
+	// not waked up until received
+	if (env->env_ipc_recving == 0)
+		ipc_block_send(env, value, srcva, perm);
+
+	if ((r = ipc_deliver(curenv, env, value, srcva, perm)) < 0) {
+		spin_unlock(&env_lock);
+		return r;
 	}
-	env->env_ipc_recving = 0;
-	env->env_ipc_from = curenv->env_id;
-	env->env_ipc_value = value;
-	env->env_status = ENV_RUNNABLE;
-	env->env_tf.tf_regs.reg_eax = 0;
+	env_set_status(env, ENV_RUNNABLE);
+	spin_unlock(&env_lock);
 	return 0;
 }
 
+// Send to 'envid' as sys_ipc_try_send does, but the value and pages
+// sent are those of the message at 'umsg': each of its ranges is
+// checked as sys_ipc_try_send checks 'srcva', with the range's perm,
+// and the receiver maps them all back to back in its window.
+//
+// Returns 0 on success, < 0 on error.  Errors are as for
+// sys_ipc_try_send, and:
+//	-E_FAULT if umsg is not readable.
+//	-E_INVAL if the message has more than IPC_VEC_MAX ranges, more
+//		than IPC_MAXPAGES pages in all, or a range that is not
+//		page-aligned or runs above UTOP.
+//	-E_INVAL if the receiver's window is too small for the pages.
+static int
+sys_ipc_sendv(envid_t envid, const struct IpcMsg *umsg)
+{
+	uint32_t value;
+	int r;
+
+	if ((r = ipc_copyin_msg(umsg, &value)) < 0)
+		return r;
+	r = sys_ipc_try_send(envid, value, NULL, 0);
+	curenv->env_ipc_nvec = 0;
+	return r;
+}
+
+// Receive as sys_ipc_recv does, but into a window of 'npages' pages at
+// 'dstva', which a vectored send can fill.  thisenv->env_ipc_npages
+// tells how many pages came.
+static int
+sys_ipc_recvv(void *dstva, size_t npages)
+{
+	int r;
+
+	if ((r = ipc_check_window(&dstva, npages)) < 0)
+		return r;
+
+	spin_lock(&env_lock);
+	if (ipc_recv_queued(dstva, npages)) {
+		spin_unlock(&env_lock);
+		return 0;
+	}
+
+	curenv->env_ipc_recving = 1;
+	sched_boost_env(curenv);
+	env_deschedule(ENV_NOT_RUNNABLE);
+	spin_unlock(&env_lock);
+	sched_yield();
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -450,95 +992,253 @@ sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_recv not implemented");
+	return sys_ipc_recvv(dstva, 1);
+}
+
+// Send 'value', and the page at 'srcva' with 'perm', to 'envid' as
+// sys_ipc_try_send does, but without waiting for it to receive: if it
+// isn't already waiting, the message is left in its mailbox, and the
+// page stays referenced from there until then.
+//
+// Returns 0 on success, < 0 on error.  Errors are as for
+// sys_ipc_try_send, and:
+//	-E_AGAIN if envid's mailbox is full.
+static int
+sys_ipc_send_async(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct MboxMsg msg;
+	struct Env *env;
 	int r;
-	if (dstva != NULL && (uintptr_t)dstva < UTOP) {
-		if ((uintptr_t)dstva % PGSIZE) 
-			return -E_INVAL;
-		curenv->env_ipc_dstva = dstva;
-	} else {
-		curenv->env_ipc_dstva = NULL;
-	}
-
-	// traverse all envs to find pending senders
-	for (int i = 0; i < NENV; i++) {
-		if (envs[i].env_ipc_sending == 1 && envs[i].env_ipc_send_envid == curenv->env_id) {
-			void *srcva = envs[i].env_ipc_srcva;
-			int perm = envs[i].env_ipc_send_perm;
-			if (srcva != NULL && (uintptr_t)srcva < UTOP && dstva != NULL && (uintptr_t)dstva < UTOP) {
-				if ((uintptr_t)srcva % PGSIZE) {
-					envs[i].env_tf.tf_regs.reg_eax = -E_INVAL;
-					envs[i].env_ipc_sending = 0;
-					envs[i].env_status = ENV_RUNNABLE;
-					continue;
-				}
-				if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P)) {
-					envs[i].env_tf.tf_regs.reg_eax = -E_INVAL;
-					envs[i].env_ipc_sending = 0;
-					envs[i].env_status = ENV_RUNNABLE;
-					continue;
-				}
-				pte_t *pte = NULL;
-				struct PageInfo *pp = page_lookup(envs[i].env_pgdir, srcva, &pte);
-				if (pp == NULL) {
-					envs[i].env_tf.tf_regs.reg_eax = -E_INVAL;
-					envs[i].env_ipc_sending = 0;
-					envs[i].env_status = ENV_RUNNABLE;
-					continue;
-				}
-				if ((perm & PTE_W) && !(*pte & PTE_W)) {
-					envs[i].env_tf.tf_regs.reg_eax = -E_INVAL;
-					envs[i].env_ipc_sending = 0;
-					envs[i].env_status = ENV_RUNNABLE;
-					continue;
-				}
-				if ((r = page_insert(curenv->env_pgdir, pp, dstva, perm)) < 0) {
-					envs[i].env_tf.tf_regs.reg_eax = r;
-					envs[i].env_ipc_sending = 0;
-					envs[i].env_status = ENV_RUNNABLE;
-					continue;
-				}
-				if ((r = page_insert(curenv->env_kern_pgdir, pp, dstva, perm)) < 0) {
-					page_remove(curenv->env_pgdir, dstva);
-					envs[i].env_tf.tf_regs.reg_eax = r;
-					envs[i].env_ipc_sending = 0;
-					envs[i].env_status = ENV_RUNNABLE;
-					continue;
-				}
-				curenv->env_ipc_perm = perm;
-			} else {
-				curenv->env_ipc_perm = 0;
-			}
-			curenv->env_ipc_recving = 0;
-			curenv->env_ipc_from = envs[i].env_id;
-			curenv->env_ipc_value = envs[i].env_ipc_send_value;
-			envs[i].env_ipc_sending = 0;
-			envs[i].env_status = ENV_RUNNABLE;
-			envs[i].env_tf.tf_regs.reg_eax = 0;
-			return 0;
+
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &env, false)) < 0)
+		goto out;
+
+	// A waiting receiver's mailbox is empty, so this is next
+	if (env->env_ipc_recving) {
+		if ((r = ipc_deliver(curenv, env, value, srcva, perm)) == 0)
+			env_set_status(env, ENV_RUNNABLE);
+		goto out;
+	}
+
+	msg.mm_from = curenv->env_id;
+	msg.mm_value = value;
+	msg.mm_page = NULL;
+	msg.mm_perm = 0;
+	if (srcva != NULL && (uintptr_t)srcva < UTOP) {
+		env_vm_lock(curenv);
+		if ((r = ipc_page_lookup(curenv, srcva, perm, &msg.mm_page)) == 0)
+			page_incref(msg.mm_page);
+		env_vm_unlock(curenv);
+		if (r < 0)
+			goto out;
+		msg.mm_perm = perm;
+	}
+	if ((r = mbox_put(env, &msg)) < 0 && msg.mm_page)
+		page_decref(msg.mm_page);
+out:
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Receive as sys_ipc_recv does, but only a message that is already
+// waiting: one in the mailbox, or from a sender blocked sending to us.
+//
+// Returns 0 if a message was received, < 0 on error.  Errors are:
+//	-E_AGAIN if there was none.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int
+sys_ipc_try_recv(void *dstva)
+{
+	bool got;
+	int r;
+
+	if ((r = ipc_check_window(&dstva, 1)) < 0)
+		return r;
+
+	spin_lock(&env_lock);
+	got = ipc_recv_queued(dstva, 1);
+	spin_unlock(&env_lock);
+	return got ? 0 : -E_AGAIN;
+}
+
+// Send 'value', and the page at 'srcva' with 'perm', to 'envid' as
+// sys_ipc_try_send does, then wait for the reply as sys_ipc_recv(dstva)
+// does, all in one system call.  If the target is waiting to receive,
+// it runs at once on this CPU in the caller's place, without a pass
+// through the scheduler.  Otherwise the caller queues as any sender
+// would, and waits for the reply once the target takes its message.
+//
+// The reply may fill a window of 'npages' pages at 'dstva'.
+//
+// Returns 0 once the reply has arrived, < 0 on error as for
+// sys_ipc_try_send and sys_ipc_recvv.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva, size_t npages)
+{
+	struct Env *env;
+	int r;
+
+	if ((r = ipc_check_window(&dstva, npages)) < 0)
+		return r;
+
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &env, false)) < 0) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstpages = npages;
+	if (env->env_ipc_recving == 0) {
+		curenv->env_ipc_calling = 1;
+		ipc_block_send(env, value, srcva, perm);
+	}
+
+	if ((r = ipc_deliver(curenv, env, value, srcva, perm)) < 0) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+	ipc_handoff(env);
+}
+
+// The server's side of sys_ipc_call: reply to 'envid' as
+// sys_ipc_try_send does, then wait for the next request as
+// sys_ipc_recv(dstva) does.  With envid 0 there is no reply, only the
+// wait.  If a request is already queued the server takes it and keeps
+// the CPU; if not, the client it replied to runs at once on this CPU in
+// its place.  A client that is yet to wait for its reply gets it when
+// it does, and the server then waits as usual.
+//
+// Requests are received in a window of 'npages' pages at 'dstva'.
+//
+// Returns 0 once a request has arrived, < 0 if the reply failed, as for
+// sys_ipc_try_send, or if the window is bad, as for sys_ipc_recvv.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		   void *dstva, size_t npages)
+{
+	struct Env *env = NULL;
+	int r;
+
+	if ((r = ipc_check_window(&dstva, npages)) < 0)
+		return r;
+
+	spin_lock(&env_lock);
+	if (envid) {
+		if ((r = envid2env(envid, &env, false)) < 0) {
+			spin_unlock(&env_lock);
+			return r;
+		}
+		if (env->env_ipc_recving == 0) {
+			curenv->env_ipc_dstva = dstva;
+			curenv->env_ipc_dstpages = npages;
+			curenv->env_ipc_calling = 1;
+			ipc_block_send(env, value, srcva, perm);
+		}
+		if ((r = ipc_deliver(curenv, env, value, srcva, perm)) < 0) {
+			spin_unlock(&env_lock);
+			return r;
 		}
 	}
 
+	if (ipc_recv_queued(dstva, npages)) {
+		if (env)
+			env_set_status(env, ENV_RUNNABLE);
+		spin_unlock(&env_lock);
+		return 0;
+	}
+	if (env)
+		ipc_handoff(env);
+
 	curenv->env_ipc_recving = 1;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_boost_env(curenv);
+	env_deschedule(ENV_NOT_RUNNABLE);
+	spin_unlock(&env_lock);
 	sched_yield();
-	return 0;
 }
 
+// sys_ipc_call with the vectored message at 'umsg', as for
+// sys_ipc_sendv.
 static int
-sys_map_kernel_page(void* kpage, void* va)
+sys_ipc_callv(envid_t envid, const struct IpcMsg *umsg, void *dstva, size_t npages)
 {
-    int r;
-    struct PageInfo* p = pa2page(PADDR(kpage));
-    if (p == NULL)
-        return -E_INVAL;
-    if ((r = page_insert(curenv->env_pgdir, p, va, PTE_U | PTE_W)) < 0) {
+	uint32_t value;
+	int r;
+
+	if ((r = ipc_copyin_msg(umsg, &value)) < 0)
 		return r;
-	}
-	if ((r = page_insert(curenv->env_kern_pgdir, p, va, PTE_U | PTE_W)) < 0) {
-		page_remove(curenv->env_pgdir, va);
+	r = sys_ipc_call(envid, value, NULL, 0, dstva, npages);
+	curenv->env_ipc_nvec = 0;
+	return r;
+}
+
+// sys_ipc_reply_wait with the vectored reply at 'umsg', as for
+// sys_ipc_sendv.
+static int
+sys_ipc_reply_waitv(envid_t envid, const struct IpcMsg *umsg, void *dstva, size_t npages)
+{
+	uint32_t value;
+	int r;
+
+	if ((r = ipc_copyin_msg(umsg, &value)) < 0)
+		return r;
+	r = sys_ipc_reply_wait(envid, value, NULL, 0, dstva, npages);
+	curenv->env_ipc_nvec = 0;
+	return r;
+}
+
+// Sleep as long as the word at 'addr' holds 'val', until another env
+// that maps the same memory wakes us with sys_futex_wake, or for at
+// most 'timeout' milliseconds if timeout isn't 0.  Wakeups may be
+// spurious: callers check the word again.
+//
+// Returns 0 once woken, < 0 on error.  Errors are:
+//	-E_AGAIN if the word doesn't hold 'val'.
+//	-E_TIMEOUT if the timeout ran out.
+//	-E_INVAL if addr is above UTOP or not 4-byte aligned.
+//	-E_FAULT if addr is not mapped.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val, unsigned timeout)
+{
+	int r;
+
+	spin_lock(&env_lock);
+	if ((r = futex_wait(curenv, addr, val, timeout)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
 	}
-    return 0;
+	sched_boost_env(curenv);
+	env_deschedule(ENV_NOT_RUNNABLE);
+	spin_unlock(&env_lock);
+	sched_yield();
+}
+
+// Wake up to 'n' envs sleeping on the word at 'addr', oldest first.
+// Returns the number woken, or < 0 on error.  Errors are as for
+// sys_futex_wait.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	int r;
+
+	spin_lock(&env_lock);
+	r = futex_wake(curenv, addr, n);
+	spin_unlock(&env_lock);
+	return r;
+}
+
+static int
+sys_map_kernel_page(void* kpage, void* va)
+{
+	int r;
+	struct PageInfo* p = pa2page(PADDR(kpage));
+	if (p == NULL)
+		return -E_INVAL;
+	env_vm_lock(curenv);
+	r = user_page_insert(curenv, p, va, PTE_U | PTE_W);
+	env_vm_unlock(curenv);
+	return r;
 }
 
 static int
@@ -550,17 +1250,17 @@ sys_sbrk(uint32_t inc)
 		panic("sys_sbrk: out of memory");
 
 	int r;
+	env_vm_lock(curenv);
 	for (uintptr_t i = curenv->env_brk; i < brk_inc; i += PGSIZE) {
 		struct PageInfo *page = page_alloc(0);
 		if (page == NULL) 
 			panic("sys_sbrk: page_alloc failed");
-		if ((r = page_insert(curenv->env_pgdir, page, (void *)i, PTE_W | PTE_U)) < 0) 
-			panic("sys_sbrk: %e", r); 
-		if ((r = page_insert(curenv->env_kern_pgdir, page, (void *)i, PTE_W | PTE_U)) < 0) 
+		if ((r = user_page_insert(curenv, page, (void *)i, PTE_W | PTE_U)) < 0) 
 			panic("sys_sbrk: %e", r); 
 	}
 
 	curenv->env_brk = brk_inc;
+	env_vm_unlock(curenv);
     return brk_inc;
 }
 
@@ -583,14 +1283,17 @@ sys_net_send(const void *buf, uint32_t len)
 	int r;
 	if (len <= 0 || len > TX_PACKET_SIZE) 
 		return -E_INVAL;
+	// Keep buf mapped while the driver copies it
+	env_vm_lock(curenv);
 	if ((r = user_mem_check(curenv, buf, len, PTE_U)) < 0) 
-		return r;
+		goto out;
 	pte_t *pte = pgdir_walk(curenv->env_pgdir, buf, false);
 	if (pte == NULL) 
 		panic("e1000_tx: pgdir_walk failed");
-	if ((r = e1000_tx(buf, len)) < 0) 
-		return r;
-	return 0;
+	r = e1000_tx(buf, len);
+out:
+	env_vm_unlock(curenv);
+	return r;
 }
 
 int
@@ -603,9 +1306,11 @@ sys_net_recv(void *buf, uint32_t len)
 	int r;
 	if (len <= 0 || len > RX_PACKET_SIZE) 
 		return -E_INVAL;
-	if ((r = user_mem_check(curenv, buf, len, PTE_U | PTE_W)) < 0) 
-		return r;
-	return e1000_rx(buf, len);
+	env_vm_lock(curenv);
+	if ((r = user_mem_check(curenv, buf, len, PTE_U | PTE_W)) == 0) 
+		r = e1000_rx(buf, len);
+	env_vm_unlock(curenv);
+	return r;
 }
 
 #ifdef ZERO_COPY
@@ -624,6 +1329,66 @@ sys_net_rdt()
 }
 #endif
 
+// Run the first n calls queued in our batch page at USYSBATCH, in
+// order, storing each one's result in its entry's sb_ret.  Only calls
+// that neither block nor give up the CPU can be batched; any other
+// fails with -E_INVAL and the rest of the batch still runs.
+// With n == 0, just map the batch page, allocating it the first time.
+//
+// Returns 0 if every call succeeded, otherwise the first error.
+//	-E_INVAL if n > SYSBATCH_MAX.
+//	-E_NO_MEM if the batch page can't be allocated or mapped.
+static int
+sys_submit(uint32_t n)
+{
+	struct SysBatchEntry ent;
+	struct PageInfo *pp;
+	uint32_t i;
+	int r, err = 0;
+
+	if (n > SYSBATCH_MAX)
+		return -E_INVAL;
+	// The env_batch reference keeps the page ours whatever the user
+	// maps at USYSBATCH, so the calls below can't fault on it
+	if (!curenv->env_batch) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		pp->pp_ref += 1;
+		curenv->env_batch = page2kva(pp);
+	}
+	if (n == 0) {
+		env_vm_lock(curenv);
+		r = user_page_insert(curenv, pa2page(PADDR(curenv->env_batch)),
+				     (void *) USYSBATCH, PTE_U | PTE_W | PTE_P);
+		env_vm_unlock(curenv);
+		return r;
+	}
+
+	for (i = 0; i < n; i++) {
+		// The page is writable at USYSBATCH, by sfork'd siblings on
+		// other CPUs too: check and run a copy, so that nothing
+		// changes the call between the two
+		ent = curenv->env_batch->sb_ent[i];
+		switch (ent.sb_num) {
+		case SYS_page_alloc:
+		case SYS_page_map:
+		case SYS_page_unmap:
+		case SYS_page_alloc_large:
+		case SYS_env_set_pgfault_upcall:
+		case SYS_env_set_priority:
+			r = syscall(ent.sb_num, ent.sb_args[0], ent.sb_args[1],
+				    ent.sb_args[2], ent.sb_args[3], ent.sb_args[4]);
+			break;
+		default:
+			r = -E_INVAL;
+		}
+		curenv->env_batch->sb_ent[i].sb_ret = r;
+		if (r < 0 && err == 0)
+			err = r;
+	}
+	return err;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -662,10 +1427,22 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			ret = sys_exofork();
 			break;
 		}
+		case SYS_fork: {
+			ret = sys_fork(a1);
+			break;
+		}
+		case SYS_env_load_elf: {
+			ret = sys_env_load_elf(a1, (void *) a2, a3);
+			break;
+		}
 		case SYS_env_set_status: {
 			ret = sys_env_set_status(a1, a2);
 			break;
 		}
+		case SYS_env_set_priority: {
+			ret = sys_env_set_priority(a1, a2);
+			break;
+		}
 		case SYS_env_set_trapframe: {
 			ret = sys_env_set_trapframe(a1, (void*)a2);
 			break;
@@ -686,7 +1463,19 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			ret = sys_page_unmap(a1, (void*)a2);
 			break;
 		}
+		case SYS_page_alloc_large: {
+			ret = sys_page_alloc_large(a1, (void*)a2, a3);
+			break;
+		}
+		case SYS_submit: {
+			ret = sys_submit(a1);
+			break;
+		}
 		case SYS_ipc_try_send: {
+			// A vectored send that never returned must not
+			// leave its ranges to this one, or to the plain
+			// calls below
+			curenv->env_ipc_nvec = 0;
 			ret = sys_ipc_try_send(a1, a2, (void*)a3, a4);
 			break;
 		}
@@ -694,6 +1483,48 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			ret = sys_ipc_recv((void*)a1);
 			break;
 		}
+		case SYS_ipc_send_async: {
+			ret = sys_ipc_send_async(a1, a2, (void*)a3, a4);
+			break;
+		}
+		case SYS_ipc_try_recv: {
+			ret = sys_ipc_try_recv((void*)a1);
+			break;
+		}
+		case SYS_ipc_call: {
+			curenv->env_ipc_nvec = 0;
+			ret = sys_ipc_call(a1, a2, (void*)a3, a4, (void*)a5, 1);
+			break;
+		}
+		case SYS_ipc_reply_wait: {
+			curenv->env_ipc_nvec = 0;
+			ret = sys_ipc_reply_wait(a1, a2, (void*)a3, a4, (void*)a5, 1);
+			break;
+		}
+		case SYS_ipc_sendv: {
+			ret = sys_ipc_sendv(a1, (const struct IpcMsg*)a2);
+			break;
+		}
+		case SYS_ipc_recvv: {
+			ret = sys_ipc_recvv((void*)a1, a2);
+			break;
+		}
+		case SYS_ipc_callv: {
+			ret = sys_ipc_callv(a1, (const struct IpcMsg*)a2, (void*)a3, a4);
+			break;
+		}
+		case SYS_ipc_reply_waitv: {
+			ret = sys_ipc_reply_waitv(a1, (const struct IpcMsg*)a2, (void*)a3, a4);
+			break;
+		}
+		case SYS_futex_wait: {
+			ret = sys_futex_wait((uint32_t*)a1, a2, a3);
+			break;
+		}
+		case SYS_futex_wake: {
+			ret = sys_futex_wake((uint32_t*)a1, a2);
+			break;
+		}
 		case SYS_map_kernel_page: {
 			ret = sys_map_kernel_page((void*)a1, (void*)a2);
 			break;
@@ -1,5 +1,7 @@
 #include <kern/time.h>
+#include <kern/pmap.h>
 #include <inc/assert.h>
+#include <inc/info.h>
 
 static unsigned int ticks;
 
@@ -17,6 +19,7 @@ time_tick(void)
 	ticks++;
 	if (ticks * 10 < ticks)
 		panic("time_tick: time overflowed");
+	sysinfo->si_msec = ticks * 10;
 }
 
 unsigned int
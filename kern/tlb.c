@@ -0,0 +1,232 @@
+// Cross-CPU TLB shootdown.
+//
+// tlb_invalidate() flushes the running CPU's TLB at once.  The other
+// CPUs that may cache a changed mapping, those in the env's
+// env_cpumask, are shot down together when this CPU releases the last
+// env VM lock it holds: one IPI per target per batch, not one per page.
+// Pages unmapped meanwhile are freed only after every target has
+// flushed, so that nothing reaches a reused page through a stale entry.
+//
+// The kernel runs with interrupts off and so can't take the IPI while
+// it waits, whether for a spinlock or for its own shootdown to finish.
+// Those waits poll for requests instead.
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/trap.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/tlb.h>
+
+// Above this many pages, targets reload %cr3 instead of using invlpg.
+#define TLB_BATCH_MAX	32
+
+struct TlbBatch {
+	struct Env *tb_envs[2];		// Envs whose VM lock we hold
+	int tb_nenvs;
+	uint32_t tb_cpus;		// Other CPUs to shoot down
+	int tb_nva;			// > TLB_BATCH_MAX: flush everything
+	uintptr_t tb_va[TLB_BATCH_MAX];
+	struct PageInfo *tb_free;	// Pages to free after the shootdown,
+	struct PageInfo *tb_free_large;	// linked through pp_link
+	volatile uint32_t tb_waiting;	// Targets yet to flush
+
+	// Statistics, for memstat
+	uint32_t tb_nbatches;		// Batches that needed other CPUs
+	uint32_t tb_nipis;
+	uint32_t tb_nfull;		// ... sent as full flushes
+	uint32_t tb_npages;		// Pages invalidated remotely
+	uint32_t tb_ndeferred;		// Page frees held back
+} __attribute__((aligned(64)));
+
+static struct TlbBatch tlb_batches[NCPU];
+
+// For each CPU, the CPUs whose batches it has yet to apply.
+static volatile uint32_t tlb_requests[NCPU];
+
+//
+// Start collecting invalidations for e.  Called with e's VM lock held.
+//
+void
+tlb_batch_enter(struct Env *e)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+
+	assert(tb->tb_nenvs < 2);
+	tb->tb_envs[tb->tb_nenvs++] = e;
+}
+
+//
+// Note that va has changed in pgdir, which this CPU has already
+// flushed.  Other CPUs are only shot down if pgdir belongs to an env
+// whose VM lock we hold; any other pgdir has never been loaded.
+//
+void
+tlb_batch_add(pde_t *pgdir, void *va)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+	uint32_t others = 0;
+	int i;
+
+	for (i = 0; i < tb->tb_nenvs; i++) {
+		struct Env *e = tb->tb_envs[i];
+
+		// The locked read orders it after the PTE write, so any
+		// CPU that joins env_cpumask later loads the new PTE.
+		if (e->env_pgdir == pgdir || e->env_kern_pgdir == pgdir)
+			others |= xadd(&e->env_cpumask, 0);
+	}
+	others &= ~(1 << cpunum());
+	if (!others)
+		return;
+
+	tb->tb_cpus |= others;
+	if (tb->tb_nva < TLB_BATCH_MAX)
+		tb->tb_va[tb->tb_nva] = (uintptr_t) va;
+	if (tb->tb_nva <= TLB_BATCH_MAX)
+		tb->tb_nva++;
+}
+
+//
+// Hold back freeing pp, a block of 2^order pages, until the current
+// batch has been shot down.  Returns false if there is nothing to wait
+// for, and the caller should free it now.
+//
+bool
+tlb_defer_free(struct PageInfo *pp, int order)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+
+	if (!tb->tb_cpus)
+		return false;
+	if (order == 0) {
+		pp->pp_link = tb->tb_free;
+		tb->tb_free = pp;
+	} else {
+		assert(order == BUDDY_MAX_ORDER);
+		pp->pp_link = tb->tb_free_large;
+		tb->tb_free_large = pp;
+	}
+	tb->tb_ndeferred++;
+	return true;
+}
+
+// Apply every batch other CPUs have asked us to.
+static void
+tlb_apply_requests(int me)
+{
+	uint32_t from = xchg(&tlb_requests[me], 0);
+	struct TlbBatch *tb;
+	int i, j;
+
+	for (i = 0; from; i++) {
+		if (!(from & (1 << i)))
+			continue;
+		from &= ~(1 << i);
+		tb = &tlb_batches[i];
+		if (tb->tb_nva > TLB_BATCH_MAX)
+			lcr3(rcr3());
+		else
+			for (j = 0; j < tb->tb_nva; j++)
+				invlpg((void *) tb->tb_va[j]);
+		atomic_and(&tb->tb_waiting, ~(1 << me));
+	}
+}
+
+// Shoot down tb's targets, then free what was held back.
+static void
+tlb_batch_flush(struct TlbBatch *tb)
+{
+	int i, me = tb - tlb_batches;
+	struct PageInfo *pp;
+
+	if (tb->tb_cpus) {
+		tb->tb_waiting = tb->tb_cpus;
+		for (i = 0; i < ncpu; i++) {
+			if (!(tb->tb_cpus & (1 << i)))
+				continue;
+			atomic_or(&tlb_requests[i], 1 << me);
+			lapic_ipi_cpu(cpus[i].cpu_id, T_TLBSHOOT);
+			tb->tb_nipis++;
+		}
+		while (tb->tb_waiting) {
+			tlb_apply_requests(me);
+			asm volatile("pause");
+		}
+
+		tb->tb_nbatches++;
+		if (tb->tb_nva > TLB_BATCH_MAX)
+			tb->tb_nfull++;
+		else
+			tb->tb_npages += tb->tb_nva;
+		tb->tb_cpus = 0;
+		tb->tb_nva = 0;
+	}
+
+	while ((pp = tb->tb_free) != NULL) {
+		tb->tb_free = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+	while ((pp = tb->tb_free_large) != NULL) {
+		tb->tb_free_large = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free_contig(pp, BUDDY_MAX_ORDER);
+	}
+}
+
+//
+// Stop collecting for e; if it was the last env, send the batch out.
+// Called with e's VM lock still held.
+//
+void
+tlb_batch_exit(struct Env *e)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+	int i;
+
+	for (i = 0; i < tb->tb_nenvs && tb->tb_envs[i] != e; i++)
+		/* do nothing */;
+	assert(i < tb->tb_nenvs);
+	tb->tb_envs[i] = tb->tb_envs[--tb->tb_nenvs];
+	if (tb->tb_nenvs == 0)
+		tlb_batch_flush(tb);
+}
+
+// The T_TLBSHOOT interrupt handler.
+void
+tlb_shootdown_intr(void)
+{
+	tlb_apply_requests(cpunum());
+	lapic_eoi();
+}
+
+// Called by code that waits with interrupts off.
+void
+tlb_shootdown_poll(void)
+{
+	int me = cpunum();
+
+	if (tlb_requests[me])
+		tlb_apply_requests(me);
+}
+
+void
+tlb_print_stats(void)
+{
+	uint32_t nbatches = 0, nipis = 0, nfull = 0, npages = 0, ndeferred = 0;
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		nbatches += tlb_batches[i].tb_nbatches;
+		nipis += tlb_batches[i].tb_nipis;
+		nfull += tlb_batches[i].tb_nfull;
+		npages += tlb_batches[i].tb_npages;
+		ndeferred += tlb_batches[i].tb_ndeferred;
+	}
+	cprintf("tlb shootdown: %u batches, %u IPIs, %u full flushes, "
+		"%u pages, %u frees deferred\n",
+		nbatches, nipis, nfull, npages, ndeferred);
+}
@@ -0,0 +1,26 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TLB_H
+#define JOS_KERN_TLB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+struct Env;
+
+// Batching, driven by env_vm_lock() and env_vm_unlock().
+void	tlb_batch_enter(struct Env *e);
+void	tlb_batch_exit(struct Env *e);
+void	tlb_batch_add(pde_t *pgdir, void *va);
+bool	tlb_defer_free(struct PageInfo *pp, int order);
+
+// Shootdown requests from other CPUs.
+void	tlb_shootdown_intr(void);
+void	tlb_shootdown_poll(void);
+
+void	tlb_print_stats(void);
+
+#endif	// !JOS_KERN_TLB_H
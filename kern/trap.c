@@ -15,6 +15,8 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/kpti.h>
+#include <kern/tlb.h>
+#include <kern/futex.h>
 
 // static struct Taskstate ts;
 
@@ -86,6 +88,8 @@ void align_handler();
 void mchk_handler();
 void simderr_handler();
 void syscall_handler();
+void tlbshoot_handler();
+void sysenter_handler();
 void irq0_handler();
 void irq1_handler();
 void irq2_handler();
@@ -128,6 +132,7 @@ trap_init(void)
 	SETGATE(idt[T_MCHK], 0, GD_KT, mchk_handler, 0);
 	SETGATE(idt[T_SIMDERR], 0, GD_KT, simderr_handler, 0);
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, syscall_handler, 3);
+	SETGATE(idt[T_TLBSHOOT], 0, GD_KT, tlbshoot_handler, 0);
 	SETGATE(idt[IRQ_OFFSET + 0], 0, GD_KT, irq0_handler, 0);
 	SETGATE(idt[IRQ_OFFSET + 1], 0, GD_KT, irq1_handler, 3);
 	SETGATE(idt[IRQ_OFFSET + 2], 0, GD_KT, irq2_handler, 0);
@@ -153,6 +158,8 @@ trap_init(void)
 void
 trap_init_percpu(void)
 {
+	uint32_t edx;
+
 	// The example code here sets up the Task State Segment (TSS) and
 	// the TSS descriptor for CPU 0. But it is incorrect if we are
 	// running on other CPUs because each CPU has its own kernel stack.
@@ -195,6 +202,14 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// sysenter enters at sysenter_handler on this CPU's kernel stack
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_SEP) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT, 0);
+		wrmsr(MSR_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0, 0);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler, 0);
+	}
 }
 
 void
@@ -280,12 +295,19 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// Another CPU changed a mapping we may cache.
+	if (tf->tf_trapno == T_TLBSHOOT) {
+		tlb_shootdown_intr();
+		return;
+	}
+
 	// Add time tick increment to clock interrupts.
 	// Be careful! In multiprocessors, clock interrupts are
 	// triggered on every CPU.
 	// LAB 6: Your code here.
 	if (thiscpu->cpu_id == 0 && tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		time_tick();
+		futex_tick();
 	}
 	
 	// Handle clock interrupts. Don't forget to acknowledge the
@@ -293,8 +315,7 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		lapic_eoi();
-		sched_yield();
-		assert(false);
+		sched_tick();
 	}
 
 	// Handle keyboard and serial interrupts.
@@ -314,11 +335,36 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_cs == GD_KT)
 		panic("unhandled trap in kernel");
 	else {
+		spin_lock(&env_lock);
 		env_destroy(curenv);
 		return;
 	}
 }
 
+// Trapped from user mode.  There is no big kernel lock: each
+// subsystem takes its own lock as it needs it.
+static struct Trapframe *
+trap_save_user(struct Trapframe *tf)
+{
+	assert(curenv);
+
+	// Garbage collect if current enviroment is a zombie
+	if (curenv->env_status == ENV_DYING) {
+		spin_lock(&env_lock);
+		env_free(curenv);
+		curenv = NULL;
+		spin_unlock(&env_lock);
+		sched_yield();
+	}
+
+	// Copy trap frame (which is currently on the stack)
+	// into 'curenv->env_tf', so that running the environment
+	// will restart at the trap point.
+	curenv->env_tf = *tf;
+	// The trapframe on the stack should be ignored from here on.
+	return &curenv->env_tf;
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -331,37 +377,15 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// We are no longer halted, if we were halted in sched_yield()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
-	if ((tf->tf_cs & 3) == 3) {
-		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		lock_kernel();
-		assert(curenv);
-
-		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
-			sched_yield();
-		}
-
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
-	}
+	if ((tf->tf_cs & 3) == 3)
+		tf = trap_save_user(tf);
 
 	// Record that tf is the last real trapframe so
 	// print_trapframe can print some additional information.
@@ -379,11 +403,40 @@ trap(struct Trapframe *tf)
 		sched_yield();
 }
 
+//
+// trap() for system calls that came in through sysenter_handler.  It
+// skips the generic dispatch, and returns to an env that keeps running
+// with sysexit rather than iret.  Only the first four arguments are
+// passed this way: lib/syscall.c uses int $T_SYSCALL for the fifth.
+//
+void
+syscall_trap(struct Trapframe *tf)
+{
+	extern char *panicstr;
+
+	asm volatile("cld" ::: "cc");
+	if (panicstr)
+		asm volatile("hlt");
+	assert(!(read_eflags() & FL_IF));
+
+	tf = trap_save_user(tf);
+	last_tf = tf;
+	tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx,
+				      tf->tf_regs.reg_ecx, tf->tf_regs.reg_ebx,
+				      tf->tf_regs.reg_edi, 0);
+
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		env_run_sysexit(curenv);
+	else
+		sched_yield();
+}
+
 
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -428,6 +481,16 @@ page_fault_handler(struct Trapframe *tf)
 	//   (the 'tf' variable points at 'curenv->env_tf').
 
 	// LAB 4: Your code here.
+	// Copy-on-write faults are ours to resolve, which saves the upcall
+	// and its three system calls.  The upcall still gets the rest.
+	if (tf->tf_err & FEC_WR) {
+		env_vm_lock(curenv);
+		r = user_page_cow(curenv, (void *) fault_va);
+		env_vm_unlock(curenv);
+		if (r == 0)
+			env_run(curenv);
+	}
+
 	if (curenv->env_pgfault_upcall != NULL) {
 		struct UTrapframe *utf = NULL;
 		if (tf->tf_esp >= UXSTACKTOP - PGSIZE && tf->tf_esp < UXSTACKTOP) 
@@ -435,13 +498,19 @@ page_fault_handler(struct Trapframe *tf)
 		else 
 			utf = (struct UTrapframe*)(UXSTACKTOP - sizeof(struct UTrapframe));
 			
-		user_mem_assert(curenv, utf, sizeof(struct UTrapframe), PTE_W);
+		// Keep the exception stack mapped until we're done with it
+		env_vm_lock(curenv);
+		if (user_mem_check(curenv, utf, sizeof(struct UTrapframe), PTE_U | PTE_W) < 0) {
+			env_vm_unlock(curenv);
+			user_mem_assert(curenv, utf, sizeof(struct UTrapframe), PTE_W);
+		}
 		utf->utf_fault_va = fault_va;
 		utf->utf_err = tf->tf_err;
 		utf->utf_regs = tf->tf_regs;
 		utf->utf_eip = tf->tf_eip;
 		utf->utf_eflags = tf->tf_eflags;
 		utf->utf_esp = tf->tf_esp;
+		env_vm_unlock(curenv);
 		tf->tf_eip = (uintptr_t)curenv->env_pgfault_upcall;
 		tf->tf_esp = (uintptr_t)utf;
 		env_run(curenv);
@@ -452,26 +521,41 @@ page_fault_handler(struct Trapframe *tf)
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	spin_lock(&env_lock);
 	env_destroy(curenv);
 }
 
+// Switch from curenv's env_pgdir to its env_kern_pgdir on entry from
+// user mode.
+__user_mapped_text static void
+kpti_enter(void)
+{
+	// Calculate the current CPU core number
+	int cpunum = -1;
+	uint32_t esp = read_esp();
+	for (cpunum = 0; cpunum < NCPU; cpunum++) {
+		uintptr_t kstacktop_i = KSTACKTOP - cpunum * (KSTKSIZE + KSTKGAP);
+		if (esp >= kstacktop_i - KSTKSIZE && esp <= kstacktop_i) 
+			break;
+	}
+
+	// Load the physical address of kernel page table
+	// Switch to the kernel page table
+	lcr3(PADDR(cpus[cpunum].cpu_env->env_kern_pgdir));
+}
+
 __user_mapped_text void
 switch_and_trap(struct Trapframe *frame)
 {
 	// LAB7: Your code here
-	if ((frame->tf_cs & 3) == 3) {
-		// Calculate the current CPU core number
-		int cpunum = -1;
-		uint32_t esp = read_esp();
-		for (cpunum = 0; cpunum < NCPU; cpunum++) {
-			uintptr_t kstacktop_i = KSTACKTOP - cpunum * (KSTKSIZE + KSTKGAP);
-			if (esp >= kstacktop_i - KSTKSIZE && esp <= kstacktop_i) 
-				break;
-    	}
-
-		// Load the physical address of kernel page table
-		// Switch to the kernel page table
-		lcr3(PADDR(cpus[cpunum].cpu_env->env_kern_pgdir));
-	}
+	if ((frame->tf_cs & 3) == 3)
+		kpti_enter();
 	trap(frame);
 }
+
+__user_mapped_text void
+switch_and_syscall(struct Trapframe *frame)
+{
+	kpti_enter();
+	syscall_trap(frame);
+}
@@ -0,0 +1,86 @@
+// Batched page system calls.
+//
+// Callers that map or unmap many pages back to back, like spawn, queue
+// the calls in the batch page at USYSBATCH instead of trapping for
+// each one.  A batch runs when it fills up or at batch_flush(), in one
+// sys_submit(), and in the order the calls were queued.
+//
+// Each batch_* call returns 0 once queued, so its own error is only
+// seen at the flush, which returns the first error of the batch.
+// If the batch page can't be mapped, the call is made at once.
+
+#include <inc/lib.h>
+
+#define batch	((struct SysBatch *) USYSBATCH)
+
+// Map the batch page if it isn't already.  Neither fork nor spawn
+// give it to the child, which maps its own on first use.
+static bool
+batch_ready(void)
+{
+	if ((uvpd[PDX(USYSBATCH)] & PTE_P) && (uvpt[PGNUM(USYSBATCH)] & PTE_P))
+		return true;
+	if (sys_submit(0) < 0)
+		return false;
+	batch->sb_count = 0;
+	return true;
+}
+
+static int
+batch_queue(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct SysBatchEntry *ent;
+	int r;
+
+	if (batch->sb_count == SYSBATCH_MAX && (r = batch_flush()) < 0)
+		return r;
+	ent = &batch->sb_ent[batch->sb_count++];
+	ent->sb_num = num;
+	ent->sb_args[0] = a1;
+	ent->sb_args[1] = a2;
+	ent->sb_args[2] = a3;
+	ent->sb_args[3] = a4;
+	ent->sb_args[4] = a5;
+	return 0;
+}
+
+int
+batch_page_alloc(envid_t envid, void *va, int perm)
+{
+	if (!batch_ready())
+		return sys_page_alloc(envid, va, perm);
+	return batch_queue(SYS_page_alloc, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+batch_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
+{
+	if (!batch_ready())
+		return sys_page_map(srcenv, srcva, dstenv, dstva, perm);
+	return batch_queue(SYS_page_map, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva, perm);
+}
+
+int
+batch_page_unmap(envid_t envid, void *va)
+{
+	if (!batch_ready())
+		return sys_page_unmap(envid, va);
+	return batch_queue(SYS_page_unmap, envid, (uint32_t) va, 0, 0, 0);
+}
+
+//
+// Run every queued call.
+// Returns 0 if they all succeeded, otherwise the first error.
+//
+int
+batch_flush(void)
+{
+	uint32_t n;
+
+	if (!(uvpd[PDX(USYSBATCH)] & PTE_P) || !(uvpt[PGNUM(USYSBATCH)] & PTE_P))
+		return 0;
+	if ((n = batch->sb_count) == 0)
+		return 0;
+	batch->sb_count = 0;
+	return sys_submit(n);
+}
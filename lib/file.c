@@ -6,6 +6,13 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Where large reads map the file server's pages, and where large writes
+// stage theirs, just below the file descriptor table.
+#define FILEREADWIN	(0xD0000000 - 2 * IPC_MAXPAGES * PGSIZE)
+#define FILEWRITEWIN	(0xD0000000 - IPC_MAXPAGES * PGSIZE)
+
+static envid_t fsenv;
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,7 +22,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
@@ -24,8 +30,37 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva, NULL);
+}
+
+// Like fsipc, but for the vectored requests: send the 'npages' pages
+// at 'data' too, read-only, after the request, and take up to
+// 'rcv_npages' reply pages at 'dstva'.  *rcv_npages_store, if not
+// NULL, is set to the number of reply pages that came.
+static int
+fsipcv(unsigned type, void *data, size_t npages, void *dstva, size_t rcv_npages,
+       size_t *rcv_npages_store)
+{
+	struct IpcMsg msg;
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipcv %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+
+	msg.im_value = type;
+	msg.im_nvec = 1;
+	msg.im_vec[0].iv_va = &fsipcbuf;
+	msg.im_vec[0].iv_npages = 1;
+	msg.im_vec[0].iv_perm = PTE_P | PTE_W | PTE_U;
+	if (npages) {
+		msg.im_nvec = 2;
+		msg.im_vec[1].iv_va = data;
+		msg.im_vec[1].iv_npages = npages;
+		msg.im_vec[1].iv_perm = PTE_P | PTE_U;
+	}
+	return ipc_callv(fsenv, &msg, dstva, rcv_npages, rcv_npages_store);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -116,6 +151,28 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
 	int r;
+	off_t off;
+	size_t i, npages;
+
+	// A large read maps the file server's block pages instead, so
+	// takes one round trip for up to IPC_MAXPAGES of them.  They are
+	// unmapped again after the copy, so that we don't pin them, see
+	// what the file holds later, or pass them on to forks.
+	if (n > PGSIZE) {
+		off = fd->fd_offset;
+		fsipcbuf.readv.req_fileid = fd->fd_file.id;
+		fsipcbuf.readv.req_n = n;
+		r = fsipcv(FSREQ_READV, NULL, 0, (void *) FILEREADWIN, IPC_MAXPAGES,
+			   &npages);
+		if (r >= 0) {
+			assert(r <= n);
+			memmove(buf, (char *) FILEREADWIN + PGOFF(off), r);
+		}
+		for (i = 0; i < npages; i++)
+			batch_page_unmap(0, (void *) (FILEREADWIN + i * PGSIZE));
+		batch_flush();
+		return r;
+	}
 
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
@@ -143,6 +200,31 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// LAB 5: Your code here
 	// panic("devfile_write not implemented");
 	int r;
+	size_t i, npages;
+
+	// A large write goes in pages of its own after the request.
+	// They are unmapped again after, so that forks don't inherit them.
+	if (n > sizeof(fsipcbuf.write.req_buf)) {
+		n = MIN(n, (IPC_MAXPAGES - 1) * PGSIZE);
+		npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+		for (i = 0; i < npages; i++)
+			batch_page_alloc(0, (void *) (FILEWRITEWIN + i * PGSIZE),
+					 PTE_P | PTE_W | PTE_U);
+		if ((r = batch_flush()) == 0) {
+			memmove((void *) FILEWRITEWIN, buf, n);
+			fsipcbuf.writev.req_fileid = fd->fd_file.id;
+			fsipcbuf.writev.req_n = n;
+			r = fsipcv(FSREQ_WRITEV, (void *) FILEWRITEWIN, npages, NULL, 0,
+				   NULL);
+		}
+		for (i = 0; i < npages; i++)
+			batch_page_unmap(0, (void *) (FILEWRITEWIN + i * PGSIZE));
+		batch_flush();
+		if (r < 0)
+			return r;
+		assert(r <= n);
+		return r;
+	}
 
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
@@ -188,3 +270,21 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Map the block of file fdnum that holds byte 'offset' at 'va',
+// read-only.  The page is the file server's block cache page, shared
+// rather than copied, so later writes to the file show through it.
+int
+read_map(int fdnum, off_t offset, void *va)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	return fsipc(FSREQ_MAP, va);
+}
+
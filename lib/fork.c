@@ -3,17 +3,14 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 extern void _pgfault_upcall(void);
 extern volatile pte_t uvpt[];     // VA of "virtual page table"
 extern volatile pde_t uvpd[];     // VA of current page directory
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
+// map in our own private writable copy.  The kernel resolves COW
+// faults itself, so this only sees one that it couldn't.
 //
 static void
 pgfault(struct UTrapframe *utf)
@@ -30,7 +27,7 @@ pgfault(struct UTrapframe *utf)
 
 	// LAB 4: Your code here.
 	uint32_t pn = PGNUM((uintptr_t)addr);
-	if (!(err & FEC_WR) || !(uvpd[PDX(addr)] & PTE_P) ||
+	if (!(err & FEC_WR) || !(uvpd[PDX(addr)] & PTE_P) || (uvpd[PDX(addr)] & PTE_PS) ||
 		(uvpt[pn] & (PTE_COW | PTE_P)) != (PTE_COW | PTE_P))
 		panic("pgfault: unable to access faulting address");
 
@@ -53,100 +50,46 @@ pgfault(struct UTrapframe *utf)
 	// panic("pgfault not implemented");
 }
 
-//
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	int r;
-
-	// LAB 4: Your code here.
-	// panic("duppage not implemented");
-	uintptr_t *addr = (uintptr_t*)(pn * PGSIZE);
-	if (uvpt[pn] & PTE_SHARE) {
-		if ((r = sys_page_map(0, addr, envid, addr, uvpt[pn] & PTE_SYSCALL)) < 0)
-			panic("sys_page_map: %e", r);		
-	} else if (uvpt[pn] & (PTE_W | PTE_COW)) {
-		if ((r = sys_page_map(0, addr, envid, addr, PTE_COW | PTE_U | PTE_P)) < 0)
-			panic("sys_page_map: %e", r);
-		if ((r = sys_page_map(0, addr, 0, addr, PTE_COW | PTE_U | PTE_P)) < 0)
-			panic("sys_page_map: %e", r);
-	} else {
-		if ((r = sys_page_map(0, addr, envid, addr, PTE_U | PTE_P)) < 0)
-			panic("sys_page_map: %e", r);
-	}
-
-	
-	return 0;
-}
-
 //
 // User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Set up our page fault handler appropriately, then have sys_fork
+// create the child.  The kernel maps our writable pages copy-on-write
+// in both of us, in one pass over our page tables, and gives the
+// child its own exception stack and our page fault handler.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
 // It is also OK to panic on error.
 //
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
-//
 envid_t
 fork(void)
 {
-	// LAB 4: Your code here.
-	// panic("fork not implemented");
-	int r;
 	envid_t envid;
-	uintptr_t addr;
 
 	set_pgfault_handler(pgfault);
-	envid = sys_exofork();
+	envid = sys_fork(false);
 	if (envid < 0) 
-		panic("sys_exofork: %e", envid);
-	if (envid == 0) {
-		thisenv = &envs[ENVX(sys_getenvid())];
-		return 0;
-	}
-
-	for (addr = 0; addr < UTOP; addr += PGSIZE) {
-		// User exception stack should not be mapped
-		if (addr == UXSTACKTOP - PGSIZE) 
-			continue;
-		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P)) 
-			duppage(envid, PGNUM(addr));
-	}
-
-	if ((r = sys_page_alloc(envid, (void*)(UXSTACKTOP - PGSIZE), PTE_U | PTE_W | PTE_P)) < 0) 
-		panic("sys_page_alloc: %e", r);
-
-	if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0) 
-		panic("set_pgfault_handler: %e", r);
-	
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0) 
-		panic("sys_env_set_status: %e", r);
-
+		panic("sys_fork: %e", envid);
+	// "thisenv" already refers to the child in the child
 	return envid;
 }
 
 // Challenge!
-int
+//
+// Fork a thread: a child that shares every page mapped below our
+// stack, so that each sees the other's writes to data, bss and heap,
+// and only the stack is copy-on-write.  Pages mapped later by either
+// are not shared.  thisenv, like the exception stack and batch page,
+// is per env.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	envid_t envid;
+
+	set_pgfault_handler(pgfault);
+	if ((envid = sys_fork(true)) < 0)
+		panic("sys_fork: %e", envid);
+	return envid;
 }
@@ -61,6 +61,191 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 		panic("sys_ipc_try_send: %e", r);
 }
 
+// Like ipc_send, but return without waiting for 'to_env' to receive:
+// the message waits in its mailbox instead.  'pg' is shared with
+// 'to_env' from now on, so don't reuse it for another message.
+// If the mailbox is full, wait as ipc_send does.
+// Returns 0 on success, < 0 on error.
+int
+ipc_send_async(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if ((r = sys_ipc_send_async(to_env, val, pg, perm)) == -E_AGAIN)
+		r = sys_ipc_try_send(to_env, val, pg, perm);
+	return r;
+}
+
+// Like ipc_recv, but only take a message that is already waiting.
+// If there is none, returns -E_AGAIN, with *from_env_store and
+// *perm_store set to 0.
+int32_t
+ipc_try_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if ((r = sys_ipc_try_recv(pg)) < 0) {
+		if (from_env_store != NULL)
+			*from_env_store = 0;
+		if (perm_store != NULL)
+			*perm_store = 0;
+		return r;
+	}
+	if (from_env_store != NULL)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Send 'val' (and 'pg' with 'perm', as for ipc_send) to 'to_env' and
+// wait for its reply, which is received as ipc_recv(NULL, rcv_pg,
+// perm_store) would.  If 'to_env' is already waiting it runs at once
+// in our place, so this is the fast way to make a request of a server.
+// Returns the reply's value, or < 0 if the request couldn't be sent.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
+	if ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) < 0) {
+		if (perm_store != NULL)
+			*perm_store = 0;
+		return r;
+	}
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// A server's ipc_send of its reply to 'to_env' followed by its
+// ipc_recv of the next request, in one system call.  With 'to_env' 0
+// it only waits.  If no request is pending, the client we replied to
+// runs at once in our place.
+// Returns the request's value, or < 0 if the reply couldn't be sent,
+// in which case *from_env_store is 0 and no request was received.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
+	if ((r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg)) < 0) {
+		if (from_env_store != NULL)
+			*from_env_store = 0;
+		if (perm_store != NULL)
+			*perm_store = 0;
+		return r;
+	}
+	if (from_env_store != NULL)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Like ipc_send, but send the value and page ranges of 'msg', each
+// range with its own perm, in one go.
+void
+ipc_sendv(envid_t to_env, const struct IpcMsg *msg)
+{
+	int r;
+
+	if ((r = sys_ipc_sendv(to_env, msg)) < 0)
+		panic("sys_ipc_sendv: %e", r);
+}
+
+// Like ipc_recv, but take up to 'npages' pages, mapped back to back
+// from 'pg' on.  *npages_store is set to the number that came, and
+// *perm_store to the perm of the first.
+int32_t
+ipc_recvv(envid_t *from_env_store, void *pg, size_t npages,
+	  int *perm_store, size_t *npages_store)
+{
+	int r;
+
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if ((r = sys_ipc_recvv(pg, npages)) < 0) {
+		if (from_env_store != NULL)
+			*from_env_store = 0;
+		if (perm_store != NULL)
+			*perm_store = 0;
+		if (npages_store != NULL)
+			*npages_store = 0;
+		return r;
+	}
+	if (from_env_store != NULL)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	if (npages_store != NULL)
+		*npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
+// ipc_call with the vectored request 'msg', taking a reply of up to
+// 'rcv_npages' pages at 'rcv_pg', as for ipc_recvv.
+int32_t
+ipc_callv(envid_t to_env, const struct IpcMsg *msg,
+	  void *rcv_pg, size_t rcv_npages, size_t *npages_store)
+{
+	int r;
+
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
+	if ((r = sys_ipc_callv(to_env, msg, rcv_pg, rcv_npages)) < 0) {
+		if (npages_store != NULL)
+			*npages_store = 0;
+		return r;
+	}
+	if (npages_store != NULL)
+		*npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
+// ipc_reply_wait with the vectored reply 'msg', taking a request of up
+// to 'rcv_npages' pages at 'rcv_pg', as for ipc_recvv.
+int32_t
+ipc_reply_waitv(envid_t to_env, const struct IpcMsg *msg,
+		envid_t *from_env_store, void *rcv_pg, size_t rcv_npages,
+		int *perm_store, size_t *npages_store)
+{
+	int r;
+
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
+	if ((r = sys_ipc_reply_waitv(to_env, msg, rcv_pg, rcv_npages)) < 0) {
+		if (from_env_store != NULL)
+			*from_env_store = 0;
+		if (perm_store != NULL)
+			*perm_store = 0;
+		if (npages_store != NULL)
+			*npages_store = 0;
+		return r;
+	}
+	if (from_env_store != NULL)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	if (npages_store != NULL)
+		*npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -5,18 +5,14 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 void
 libmain(int argc, char **argv)
 {
-	// set thisenv to point at our Env structure in envs[].
-	// LAB 3: Your code here.
-	// thisenv = 0;
-	envid_t envid = sys_getenvid();
-	thisenv = &envs[ENVX(envid)];
-	
+	// thisenv points at our Env structure in envs[] through the
+	// env info page, so there is nothing to set up.
+
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
 		binaryname = argv[0];
@@ -41,7 +41,7 @@ isfree(void *v, size_t n)
 void*
 malloc(size_t n)
 {
-	int i, cont;
+	int i, cont, r;
 	int nwrap;
 	uint32_t *ref;
 	void *v;
@@ -94,14 +94,18 @@ malloc(size_t n)
 
 	/*
 	 * allocate at mptr - the +4 makes sure we allocate a ref count.
+	 * the pages are allocated as one batch of system calls.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
+	r = 0;
+	for (i = 0; i < n + 4 && r == 0; i += PGSIZE){
 		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+		r = batch_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont);
+	}
+	if (batch_flush() < 0 || r < 0){
+		for (i = 0; i < n + 4; i += PGSIZE)
+			batch_page_unmap(0, mptr + i);
+		batch_flush();
+		return 0;	/* out of physical memory */
 	}
 
 	ref = (uint32_t*) (mptr + i - 4);
@@ -124,10 +128,11 @@ free(void *v)
 	c = ROUNDDOWN(v, PGSIZE);
 
 	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
+		batch_page_unmap(0, c);
 		c += PGSIZE;
 		assert(mbegin <= c && c < mend);
 	}
+	batch_flush();
 
 	/*
 	 * c is just a piece of this page, so dec the ref count
@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -19,10 +20,16 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// A blocked end sleeps at most this long before it looks again whether
+// the other end is gone, in case that env died without closing it.
+#define PIPE_SLEEP_MSEC	100
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
+	uint32_t p_rsleep;	// a reader sleeps on p_wpos
+	uint32_t p_wsleep;	// a writer sleeps on p_rpos
 };
 
 int
@@ -101,11 +108,30 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Sleep until *pos moves from 'seen'.  The flag is raised before the
+// kernel compares *pos, so the other end either sees it after moving
+// *pos and wakes us, or moved *pos first and we don't sleep at all.
+static void
+pipe_sleep(uint32_t *sleeping, off_t *pos, off_t seen)
+{
+	xchg(sleeping, 1);
+	sys_futex_wait((uint32_t *) pos, seen, PIPE_SLEEP_MSEC);
+}
+
+// We moved *pos: wake whoever sleeps on it.
+static void
+pipe_wakeup(uint32_t *sleeping, off_t *pos)
+{
+	if (xchg(sleeping, 0))
+		sys_futex_wake((uint32_t *) pos, PIPEBUFSIZ);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
 	size_t i;
+	off_t wpos;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -115,24 +141,26 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
+		while (p->p_rpos == (wpos = p->p_wpos)) {
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer comes along
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read sleep\n");
+			pipe_sleep(&p->p_rsleep, &p->p_wpos, wpos);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+    out:
+	pipe_wakeup(&p->p_wsleep, &p->p_rpos);
 	return i;
 }
 
@@ -141,6 +169,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
 	size_t i;
+	off_t rpos;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -150,17 +179,19 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+		while (p->p_wpos >= (rpos = p->p_rpos) + sizeof(p->p_buf)) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let the readers at what we wrote,
+			// and sleep until they make room
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_wakeup(&p->p_rsleep, &p->p_wpos);
+			pipe_sleep(&p->p_wsleep, &p->p_rpos, rpos);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +199,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wakeup(&p->p_rsleep, &p->p_wpos);
 	return i;
 }
 
@@ -185,7 +217,13 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	// The other end tells we are gone from the page counts, which
+	// just changed: wake it to look
+	pipe_wakeup(&p->p_rsleep, &p->p_wpos);
+	pipe_wakeup(&p->p_wsleep, &p->p_rpos);
+	return sys_page_unmap(0, p);
 }
 
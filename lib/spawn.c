@@ -10,6 +10,11 @@ static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
+static size_t image_pages(struct Elf *elf);
+static int map_image(envid_t child, int fd, size_t npages);
+
+// The most file pages that map_image can map at UTEMP.
+#define MAXIMAGE		((PFTEMP - UTEMP) / PGSIZE)
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -26,6 +31,7 @@ spawn(const char *prog, const char **argv)
 	int fd, i, r;
 	struct Elf *elf;
 	struct Proghdr *ph;
+	size_t npages;
 	int perm;
 
 	// This code follows this procedure:
@@ -110,17 +116,24 @@ spawn(const char *prog, const char **argv)
 	if ((r = init_stack(child, argv, &child_tf.tf_esp)) < 0)
 		return r;
 
-	// Set up program segments as defined in ELF header.
-	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
-	for (i = 0; i < elf->e_phnum; i++, ph++) {
-		if (ph->p_type != ELF_PROG_LOAD)
-			continue;
-		perm = PTE_P | PTE_U;
-		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
-			perm |= PTE_W;
-		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+	// Set up program segments as defined in ELF header.  The kernel
+	// maps them straight from the file server's pages if the image
+	// fits at UTEMP; otherwise they are read in page by page.
+	if ((npages = image_pages(elf)) <= MAXIMAGE) {
+		if ((r = map_image(child, fd, npages)) < 0)
 			goto error;
+	} else {
+		ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
+		for (i = 0; i < elf->e_phnum; i++, ph++) {
+			if (ph->p_type != ELF_PROG_LOAD)
+				continue;
+			perm = PTE_P | PTE_U;
+			if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+				perm |= PTE_W;
+			if ((r = map_segment(child, ph->p_va, ph->p_memsz,
+					     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+				goto error;
+		}
 	}
 	close(fd);
 	fd = -1;
@@ -297,6 +310,43 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	return 0;
 }
 
+// The number of file pages, from the first, that hold the headers and
+// the file data of every loadable segment.
+static size_t
+image_pages(struct Elf *elf)
+{
+	struct Proghdr *ph = (struct Proghdr*) ((uint8_t*) elf + elf->e_phoff);
+	size_t npages = 1;
+	int i;
+
+	for (i = 0; i < elf->e_phnum; i++, ph++)
+		if (ph->p_type == ELF_PROG_LOAD && ph->p_filesz)
+			npages = MAX(npages, ROUNDUP(ph->p_offset + ph->p_filesz, PGSIZE) / PGSIZE);
+	return npages;
+}
+
+// Map the first npages pages of the program file at UTEMP, shared with
+// the file server's block cache, and have the kernel map the segments
+// into the child from them.  No page is copied except one where a
+// segment's data ends in its BSS, and the BSS gets memory only as the
+// child writes it.
+static int
+map_image(envid_t child, int fd, size_t npages)
+{
+	size_t i;
+	int r = 0;
+
+	for (i = 0; i < npages && r == 0; i++)
+		r = read_map(fd, i * PGSIZE, UTEMP + i * PGSIZE);
+	if (r == 0)
+		r = sys_env_load_elf(child, UTEMP, npages);
+
+	for (i = 0; i < npages; i++)
+		batch_page_unmap(0, UTEMP + i * PGSIZE);
+	batch_flush();
+	return r;
+}
+
 // Copy the mappings for shared pages into the child address space.
 static int
 copy_shared_pages(envid_t child)
@@ -307,11 +357,21 @@ copy_shared_pages(envid_t child)
 		// User exception stack should not be mapped
 		if (addr == UXSTACKTOP - PGSIZE) 
 			continue;
+		// uvpt means nothing under a large page's PDE
+		if ((uvpd[PDX(addr)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+			if ((uvpd[PDX(addr)] & PTE_SHARE) &&
+			    (r = sys_page_map(0, (void*)addr, child, (void*)addr, uvpd[PDX(addr)] & PTE_SYSCALL)) < 0)
+				panic("sys_page_map: %e", r);
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
 		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_SHARE)) {
-			if ((r = sys_page_map(0, (void*)addr, child, (void*)addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) 
+			if ((r = batch_page_map(0, (void*)addr, child, (void*)addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) 
 				panic("sys_page_map: %e", r);
 		}
 	}
+	if ((r = batch_flush()) < 0)
+		panic("sys_page_map: %e", r);
 	return 0;
 }
 
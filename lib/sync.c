@@ -0,0 +1,167 @@
+// Mutexes, condition variables and semaphores.
+//
+// The uncontended paths are a single atomic instruction.  Only an env
+// that has to wait enters the kernel, to sleep in sys_futex_wait on the
+// lock's own word, and only a release that finds sleepers calls
+// sys_futex_wake.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// For sys_futex_wake: everybody.
+#define WAKE_ALL	0x7fffffff
+
+void
+mutex_init(struct Mutex *m)
+{
+	m->m_state = 0;
+}
+
+//
+// Take m, sleeping while another env holds it.
+//
+void
+mutex_lock(struct Mutex *m)
+{
+	uint32_t c;
+
+	if ((c = cmpxchg(&m->m_state, 0, 1)) == 0)
+		return;
+	// Mark m contended, so the holder wakes us when it lets go.  We
+	// can't tell whether others sleep too, so we keep the mark once
+	// we own it.
+	if (c != 2)
+		c = xchg(&m->m_state, 2);
+	while (c != 0) {
+		sys_futex_wait(&m->m_state, 2, 0);
+		c = xchg(&m->m_state, 2);
+	}
+}
+
+// Take m if nobody holds it.  Returns true if we got it.
+bool
+mutex_trylock(struct Mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	if (xchg(&m->m_state, 0) == 2)
+		sys_futex_wake(&m->m_state, 1);
+}
+
+void
+cond_init(struct Cond *c)
+{
+	c->c_seq = 0;
+	c->c_nwait = 0;
+}
+
+//
+// Release m, wait for c to be signalled or for 'msec' milliseconds to
+// pass, then take m again.  msec 0 means no timeout.
+// Returns 0, or -E_TIMEOUT if the timeout ran out.  As with any
+// condition variable, a return doesn't mean the condition holds.
+//
+int
+cond_timedwait(struct Cond *c, struct Mutex *m, unsigned msec)
+{
+	uint32_t seq = c->c_seq;
+	int r;
+
+	xadd(&c->c_nwait, 1);
+	mutex_unlock(m);
+	r = sys_futex_wait(&c->c_seq, seq, msec);
+	xadd(&c->c_nwait, -1);
+
+	// Others woken by a broadcast may be asleep on m by now
+	while (xchg(&m->m_state, 2) != 0)
+		sys_futex_wait(&m->m_state, 2, 0);
+	return r == -E_TIMEOUT ? r : 0;
+}
+
+void
+cond_wait(struct Cond *c, struct Mutex *m)
+{
+	cond_timedwait(c, m, 0);
+}
+
+void
+cond_signal(struct Cond *c)
+{
+	xadd(&c->c_seq, 1);
+	if (c->c_nwait)
+		sys_futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct Cond *c)
+{
+	xadd(&c->c_seq, 1);
+	if (c->c_nwait)
+		sys_futex_wake(&c->c_seq, WAKE_ALL);
+}
+
+void
+sem_init(struct Sem *s, uint32_t count)
+{
+	s->s_count = count;
+	s->s_nwait = 0;
+}
+
+// Take one from s if it isn't 0.  Returns true if we did.
+bool
+sem_trywait(struct Sem *s)
+{
+	uint32_t c;
+
+	while ((c = s->s_count) > 0)
+		if (cmpxchg(&s->s_count, c, c - 1) == c)
+			return true;
+	return false;
+}
+
+//
+// Take one from s, sleeping while it is 0, for at most 'msec'
+// milliseconds if msec isn't 0.
+// Returns 0, or -E_TIMEOUT if the timeout ran out.
+//
+int
+sem_timedwait(struct Sem *s, unsigned msec)
+{
+	unsigned deadline = sys_time_msec() + msec;
+	unsigned left = 0;
+	int r;
+
+	while (!sem_trywait(s)) {
+		if (msec) {
+			left = deadline - sys_time_msec();
+			if ((int) left <= 0)
+				return -E_TIMEOUT;
+		}
+		// Counted as a sleeper before the kernel looks at s_count,
+		// so a sem_post after that look will wake us
+		xadd(&s->s_nwait, 1);
+		r = sys_futex_wait(&s->s_count, 0, left);
+		xadd(&s->s_nwait, -1);
+		if (r == -E_TIMEOUT)
+			return sem_trywait(s) ? 0 : r;
+	}
+	return 0;
+}
+
+void
+sem_wait(struct Sem *s)
+{
+	sem_timedwait(s, 0);
+}
+
+void
+sem_post(struct Sem *s)
+{
+	xadd(&s->s_count, 1);
+	if (s->s_nwait)
+		sys_futex_wake(&s->s_count, 1);
+}
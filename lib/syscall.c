@@ -2,11 +2,38 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Whether the CPU has sysenter: 1 or 0, or -1 until we have looked.
+static int have_sysenter = -1;
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
+	uint32_t edx;
+
+	if (have_sysenter < 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		have_sysenter = (edx & CPUID_SEP) != 0;
+	}
+
+	// Fast system call, for calls that leave a5 zero: the kernel
+	// passes zero for it.  sysenter saves no user state, so pass
+	// the return address in SI and the stack pointer in BP.
+	// sysexit returns the registers as they were, except CX, DX
+	// and the condition codes.
+	if (have_sysenter && a5 == 0) {
+		asm volatile("pushl %%ebp\n"
+			     "\tmovl %%esp, %%ebp\n"
+			     "\tleal 1f, %%esi\n"
+			     "\tsysenter\n"
+			     "1:\tpopl %%ebp\n"
+			     : "=a" (ret), "+d" (a1), "+c" (a2)
+			     : "0" (num), "b" (a3), "D" (a4)
+			     : "esi", "cc", "memory");
+		goto done;
+	}
 
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
@@ -30,6 +57,7 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		       "S" (a5)
 		     : "cc", "memory");
 
+done:
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
 
@@ -57,7 +85,8 @@ sys_env_destroy(envid_t envid)
 envid_t
 sys_getenvid(void)
 {
-	 return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0);
+	// From the env info page, without entering the kernel
+	return envinfo.ei_id;
 }
 
 void
@@ -72,6 +101,12 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
 }
 
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
 int
 sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 {
@@ -86,12 +121,32 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+// sys_fork needn't be: the kernel copies our stack as it was at the
+// trap, so the child returns from here just as we do.
+envid_t
+sys_fork(bool share)
+{
+	return syscall(SYS_fork, 0, share, 0, 0, 0, 0);
+}
+
+int
+sys_env_load_elf(envid_t envid, void *image, size_t npages)
+{
+	return syscall(SYS_env_load_elf, 0, envid, (uint32_t) image, npages, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -116,6 +171,72 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_send_async(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send_async, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_try_recv(void *dstva)
+{
+	return syscall(SYS_ipc_try_recv, 0, (uint32_t) dstva, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_sendv(envid_t envid, const struct IpcMsg *msg)
+{
+	return syscall(SYS_ipc_sendv, 0, envid, (uint32_t) msg, 0, 0, 0);
+}
+
+int
+sys_ipc_recvv(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recvv, 0, (uint32_t) dstva, npages, 0, 0, 0);
+}
+
+int
+sys_ipc_callv(envid_t envid, const struct IpcMsg *msg, void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_callv, 0, envid, (uint32_t) msg, (uint32_t) dstva, npages, 0);
+}
+
+int
+sys_ipc_reply_waitv(envid_t envid, const struct IpcMsg *msg, void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_reply_waitv, 0, envid, (uint32_t) msg, (uint32_t) dstva, npages, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_submit(uint32_t n)
+{
+	return syscall(SYS_submit, 0, n, 0, 0, 0, 0);
+}
+
 int
 sys_map_kernel_page(void* kpage, void* va)
 {
@@ -131,7 +252,8 @@ sys_sbrk(uint32_t inc)
 unsigned int
 sys_time_msec(void)
 {
-	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
+	// From the system info page, without entering the kernel
+	return sysinfo.si_msec;
 }
 
 int
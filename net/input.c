@@ -39,6 +39,9 @@ input(envid_t ns_envid)
 		uint32_t rdt = sys_net_rdt();
 		memcpy(&nsipcbuf.pkt.jp_data, (char *)(rx_packet_buffer + rdt * RX_PACKET_SIZE), r);
 #endif
-		ipc_send(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_U | PTE_W | PTE_P);
+		// Each packet gets a fresh page, so keep receiving while the
+		// network server catches up
+		if ((r = ipc_send_async(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_U | PTE_W | PTE_P)) < 0)
+			panic("ipc_send_async: %e", r);
 	}
 }
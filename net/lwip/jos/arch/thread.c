@@ -31,12 +31,39 @@ thread_wakeup(volatile uint32_t *addr) {
     }
 }
 
+// If every thread is in thread_wait, none of them can end another's
+// wait, so instead of yielding round and round, sleep in the kernel
+// until the nearest deadline.  Anything that comes from outside, like
+// an IPC, reaches us through a thread that is not waiting.
+static void
+thread_idle(uint32_t now) {
+    struct thread_context *tc;
+    uint32_t until = cur_tc->tc_wait_until;
+    uint32_t word = 0;
+
+    for (tc = thread_queue.tq_first; tc; tc = tc->tc_queue_link) {
+	if (!tc->tc_waiting || tc->tc_wakeup)
+	    return;
+	if (tc->tc_wait_addr && *tc->tc_wait_addr != tc->tc_wait_val)
+	    return;
+	if (tc->tc_wait_until < until)
+	    until = tc->tc_wait_until;
+    }
+
+    // Nobody else can change word, so this only times out
+    if (until > now)
+	sys_futex_wait(&word, 0, until == ~0U ? 0 : until - now);
+}
+
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
     uint32_t s = sys_time_msec();
     uint32_t p = s;
 
     cur_tc->tc_wait_addr = addr;
+    cur_tc->tc_wait_val = val;
+    cur_tc->tc_wait_until = msec;
+    cur_tc->tc_waiting = 1;
     cur_tc->tc_wakeup = 0;
 
     while (p < msec) {
@@ -47,11 +74,13 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
+	thread_idle(p);
 	thread_yield();
 	p = sys_time_msec();
     }
 
     cur_tc->tc_wait_addr = 0;
+    cur_tc->tc_waiting = 0;
     cur_tc->tc_wakeup = 0;
 }
 
@@ -24,6 +24,9 @@ struct thread_context {
     uint32_t		tc_arg;
     struct jos_jmp_buf	tc_jb;
     volatile uint32_t	*tc_wait_addr;
+    uint32_t		tc_wait_val;
+    uint32_t		tc_wait_until;
+    char		tc_waiting;
     volatile char	tc_wakeup;
     void		(*tc_onhalt[THREAD_NUM_ONHALT])(thread_id_t);
     int			tc_nonhalt;
@@ -104,7 +104,9 @@ low_level_output(struct netif *netif, struct pbuf *p)
 
     pkt->jp_len = txsize;
 
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
+    r = ipc_send_async(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
+    if (r < 0)
+	panic("jif: could not send packet: %e", r);
     sys_page_unmap(0, (void *)pkt);
 
     return ERR_OK;
@@ -347,6 +347,11 @@ umain(int argc, char **argv)
 		return;
 	}
 
+	// Like the file server, requests block on us; stay at the top
+	// level.  The helpers above are left to the scheduler, since the
+	// input env polls the NIC.
+	sys_env_set_priority(0, ENV_PRIO_HIGH);
+
 	// lwIP requires a user threading library; start the library and jump
 	// into a thread to continue initialization.
 	thread_init();
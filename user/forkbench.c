@@ -0,0 +1,66 @@
+// Measure how long fork takes to return in the parent, for an address
+// space like forktree's and for one with a few hundred more pages, and
+// what the copy-on-write faults on those pages cost afterwards.  The
+// child must still see the data the pages held at the fork.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NFORKS	20
+#define NPAGES	256
+
+static void
+bench(const char *name)
+{
+	uint64_t total = 0, start;
+	envid_t child;
+	int i;
+
+	for (i = 0; i < NFORKS; i++) {
+		start = read_tsc();
+		if ((child = fork()) == 0)
+			exit();
+		total += read_tsc() - start;
+		wait(child);
+	}
+	cprintf("%s: %u cycles per fork\n", name, (uint32_t) (total / NFORKS));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t child;
+	int i, r;
+
+	bench("forktree-sized");
+
+	// More pages for every fork to map into the child
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, UTEMP + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		((char *) UTEMP)[i * PGSIZE] = i;
+	}
+	bench("+256 pages");
+
+	// The child holds on to the pages until it exits, so each write
+	// copies one.  Once we are done, it checks that it kept the old data.
+	if ((child = fork()) == 0) {
+		ipc_recv(NULL, NULL, NULL);
+		for (i = 0; i < NPAGES; i++)
+			if (((char *) UTEMP)[i * PGSIZE] != (char) i)
+				panic("child sees the parent's write to page %d", i);
+		ipc_send(thisenv->env_parent_id, 0, NULL, 0);
+		exit();
+	}
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		((volatile char *) UTEMP)[i * PGSIZE] = i + 1;
+	cprintf("cow fault: %u cycles per page\n",
+		(uint32_t) ((read_tsc() - start) / NPAGES));
+
+	ipc_send(child, 0, NULL, 0);
+	ipc_recv(NULL, NULL, NULL);
+	wait(child);
+	cprintf("forkbench OK\n");
+}
@@ -0,0 +1,76 @@
+// Measure an IPC round trip to a server, made as an ipc_send and
+// ipc_recv pair and as one ipc_call, which hands the CPU straight to
+// the server and back.  Every reply must be the request's value plus
+// one, whichever way it was made.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	1000
+#define NROUNDS	5
+
+// Answer every request with its value plus one.
+static void
+server(void)
+{
+	envid_t whom = 0;
+	int32_t val = 0;
+
+	while (1) {
+		val = ipc_reply_wait(whom, val + 1, NULL, 0, &whom, NULL, NULL);
+		if (val < 0 && whom == 0)
+			val = 0;
+	}
+}
+
+static uint32_t
+time_calls(envid_t who, bool call)
+{
+	uint64_t start;
+	int32_t r;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++) {
+		if (call) {
+			r = ipc_call(who, i, NULL, 0, NULL, NULL);
+		} else {
+			ipc_send(who, i, NULL, 0);
+			r = ipc_recv(NULL, NULL, NULL);
+		}
+		if (r != i + 1)
+			panic("round trip %d: got %d", i, r);
+	}
+	return (uint32_t) (read_tsc() - start) / NCALLS;
+}
+
+static void
+bench(const char *name, envid_t who, bool call)
+{
+	uint32_t best = ~0, cycles;
+	int i;
+
+	// Take the best round, to leave out interrupts and cold caches
+	for (i = 0; i < NROUNDS; i++) {
+		cycles = time_calls(who, call);
+		if (cycles < best)
+			best = cycles;
+	}
+	cprintf("%s: %u cycles per round trip\n", name, best);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0)
+		server();
+
+	bench("send/recv", who, false);
+	bench("call", who, true);
+	sys_env_destroy(who);
+	cprintf("ipcbench OK\n");
+}
@@ -0,0 +1,44 @@
+// Test 4MB large-page mappings: allocation, fork, and unmap.
+
+#include <inc/lib.h>
+
+#define BIGVA	((char *) 0x20000000)
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	envid_t child;
+
+	if ((r = sys_page_alloc_large(0, BIGVA, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc_large: %e", r);
+	if (!(uvpd[PDX(BIGVA)] & PTE_PS))
+		panic("not mapped as a large page");
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		BIGVA[i] = i / PGSIZE;
+
+	// no 4KB page fits inside it
+	if ((r = sys_page_alloc(0, BIGVA + PGSIZE, PTE_P | PTE_U | PTE_W)) != -E_INVAL)
+		panic("sys_page_alloc inside a large page: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < PTSIZE; i += PGSIZE)
+			if (BIGVA[i] != (char) (i / PGSIZE))
+				panic("child: wrong data at %p", BIGVA + i);
+		BIGVA[0] = 'c';
+		return;
+	}
+	wait(child);
+	if (BIGVA[0] != 0)
+		panic("child's write reached the parent");
+
+	// unmapping any page of it unmaps all of it
+	if ((r = sys_page_unmap(0, BIGVA + PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (uvpd[PDX(BIGVA)] & PTE_P)
+		panic("large page still mapped");
+
+	cprintf("large page test passed\n");
+}
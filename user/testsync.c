@@ -0,0 +1,77 @@
+// Test the futex-based mutex, condition variable and semaphore between
+// envs sharing a PTE_SHARE page.
+
+#include <inc/lib.h>
+
+#define VA	((struct Shared *) 0xA0000000)
+#define NCHILD	4
+#define NITER	1000
+#define NROUND	100
+
+struct Shared {
+	struct Mutex mu;
+	struct Cond cv;
+	struct Sem done;
+	uint32_t counter;
+	uint32_t turn;
+};
+
+void
+umain(int argc, char **argv)
+{
+	struct Shared *s = VA;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, s, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	mutex_init(&s->mu);
+	cond_init(&s->cv);
+	sem_init(&s->done, 0);
+
+	// mutex: the children's increments must not be lost
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			for (i = 0; i < NITER; i++) {
+				mutex_lock(&s->mu);
+				s->counter++;
+				if (i % 100 == 0)
+					sys_yield();
+				mutex_unlock(&s->mu);
+			}
+			sem_post(&s->done);
+			exit();
+		}
+	}
+	for (i = 0; i < NCHILD; i++)
+		sem_wait(&s->done);
+	if (s->counter != NCHILD * NITER)
+		panic("counter is %d, not %d", s->counter, NCHILD * NITER);
+	cprintf("mutex and semaphore OK\n");
+
+	// condition variable: take turns with a child
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	for (i = 0; i < NROUND; i++) {
+		mutex_lock(&s->mu);
+		while (s->turn % 2 != (r == 0))
+			cond_wait(&s->cv, &s->mu);
+		s->turn++;
+		cond_broadcast(&s->cv);
+		mutex_unlock(&s->mu);
+	}
+	if (r == 0)
+		exit();
+	wait(r);
+	if (s->turn != 2 * NROUND)
+		panic("turn is %d, not %d", s->turn, 2 * NROUND);
+	cprintf("condition variable OK\n");
+
+	// timeouts
+	if ((r = sem_timedwait(&s->done, 50)) != -E_TIMEOUT)
+		panic("sem_timedwait returned %e, not timing out", r);
+	if ((r = sys_futex_wait(&s->counter, 0, 0)) != -E_AGAIN)
+		panic("sys_futex_wait on a changed word returned %e", r);
+	cprintf("timeouts OK\n");
+}